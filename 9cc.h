@@ -1,22 +1,33 @@
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <threads.h>
 
 
 typedef struct Type Type;
-typedef struct Initializer Initializer;
 
-struct Initializer {
-  Initializer *next;
+// ハッシュテーブル
+typedef struct {
+  char *key;
+  int keylen;
+  void *val;
+} HashEntry;
 
-  // Constant expression
-  int sz;
-  long val;
-};
+typedef struct {
+  HashEntry *buckets;
+  int capacity;
+  int used;
+} HashMap;
+
+void *hashmap_get(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, int keylen, void *val);
 
 typedef enum {
   TY_CHAR,
@@ -44,13 +55,18 @@ struct Var {
   char *name;    // Variable name
   Type *ty;      // Type
   bool is_local; // local or global
+  bool addr_taken; // アドレスが外に漏れうる(&や配列)。ローカル変数のみ
 
   // Local Variable
   int offset; // RBPからのオフセット
+  char *reg;  // Register the variable lives in, or NULL
+  char *saved_reg; // A slot that preserves this callee-saved register
+  bool whole_function; // Hidden slot used by the prologue and epilogue
 
   // Global variable
   bool is_static;
-  Initializer *initializer;
+  char *init_data; // String literal contents (ty->size - 1 bytes, the
+                   // terminating NUL is implicit)
 
   Var *next; // 次の変数かNULL
 };
@@ -80,7 +96,10 @@ typedef enum {
   ND_NUM,      // 整数
   ND_ADDR,     // unary &
   ND_DEREF,    // unary *
+  ND_EXPR_STMT, // Expression statement
   ND_NULL,     // Empty statement
+  ND_VLOOP,    // Vectorized loop
+  ND_SELECT,   // cond ? then : els, both arms evaluated
 } NodeKind;
 
 typedef struct Node Node;
@@ -105,9 +124,21 @@ struct Node {
   // 整数リテラル
   int val;
 
+  // ND_VLOOP: the operation (ND_ADD, ND_SUB, ND_EQ or ND_ASSIGN for a
+  // copy) is in val, the element type in ty, the destination address in
+  // lhs and the source addresses in args. A sum is reduced into var and
+  // then added by init.
+
   // 関数
   char *funcname;
   Node *args;
+
+  // Source position for -g
+  int line;
+  int col;
+
+  // Index of the node's first -fprofile-generate counter
+  int prof_id;
 };
 
 // トークンの種類
@@ -137,13 +168,15 @@ struct Token {
   Type *ty;        // kindがTK_NUMの場合、その数値
   char *str;       // トークン文字列
   int len;         // トークンの長さ
+  int line;        // 1-origin line and column of the token
+  int col;
 
-  char *contents;  // String literal contents including terminating '\0'
-  char cont_len;   // String literal length
+  char *contents;  // String literal contents, not NUL-terminated
+  int cont_len;    // String literal length excluding the terminator
 };
 
 // 現在着目しているトークン
-extern Token *token;
+extern _Thread_local Token *token;
 
 typedef struct Function Function;
 struct Function {
@@ -154,6 +187,17 @@ struct Function {
   Node *node;
   Var *locals;
   int stack_size;
+  int line;
+
+  // -finstrument: where the TSC at entry is kept
+  Var *prof_start;
+
+  // Number of profile counters, and their values with -fprofile-use
+  int nprof;
+  long *prof;
+
+  // Position in the source, to keep sorts stable
+  int seq;
 };
 
 typedef struct {
@@ -162,6 +206,18 @@ typedef struct {
 } Program;
 
 extern char *user_input;
+extern bool omit_frame_pointer;
+extern bool pic;
+extern int jobs;
+extern bool stream;
+extern bool instrument;
+extern bool profile_mcount;
+extern bool debug_info;
+extern int opt_level;
+extern int unroll_factor;
+extern bool profile_generate;
+extern char *profile_use;
+extern char *filename;
 
 char *strndup(const char *s, size_t n);
 void error_at(char *loc, char *fmt, ...);
@@ -177,17 +233,43 @@ Token *new_token(TokenKind kind, Token *cur, char *str, int len);
 int align_to(int n, int align);
 bool startswith(char *p, char *q);
 void tokenize();
+Token *tokenize_decl(void);
+void free_tokens(Token *tok);
 Program *program();
-Function *function();
-Node *assign();
-Node *expr();
-Node *equality();
-Node *relational();
-Node *mul();
-Node *unary();
-Node *primary();
+Function *top_level(void);
+void free_node(Node *node);
+Node *copy_node(Node *node);
+void free_function(Function *fn);
+Var *parsed_globals(void);
+Node *expr(void);
 void gen(Node *node);
 void codegen(Program *prog);
-void add_type(Node *node);
+void codegen_begin(void);
+void codegen_function(Function *fn);
+void codegen_end(Var *globals);
+void assign_lvar_offsets(Function *fn);
+void optimize(Function *fn);
+void eliminate_common_subexprs(Function *fn);
+Type *temp_type(Type *ty);
+void optimize_loops(Function *fn);
+
+typedef enum {
+  STATS_NONE,
+  STATS_TEXT,
+  STATS_JSON,
+} StatsFormat;
+
+extern StatsFormat codegen_stats;
+void stats_begin_function(char *name);
+void stats_end_function(int frame_size, int temp_size);
+void stats_data(int size);
+void stats_line(char *line);
+void print_codegen_stats(void);
+
+void assign_profile_ids(Function *fn);
+void load_profile(char *path);
+bool branch_counts(Function *fn, Node *node, long *evals, long *taken);
+long entry_count(Function *fn);
 
 extern Type *int_type;
+Type *pointer_to(Type *base);
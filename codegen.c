@@ -6,19 +6,102 @@ static char *argreg8[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 
 int labelseq = 0;
 char *funcname;
+static Function *current_fn;
+
+// Number of 8-byte values the generated code has pushed since the
+// prologue. Locals are addressed relative to rsp in -fomit-frame-pointer
+// mode, so this has to be known statically at every instruction.
+static int depth;
+static int max_depth;
+static bool has_call;
+
+// Without a frame pointer, a local at offset `off` lives at
+// [rsp + frame_top + depth*8 - off].
+static int frame_top;
+static int frame_size;
+
+// While measuring a function body nothing is printed.
+static bool dry_run;
+
+static void vemit(char *fmt, va_list ap) {
+  if (dry_run)
+    return;
+
+  if (codegen_stats) {
+    char buf[128];
+    va_list ap2;
+    va_copy(ap2, ap);
+    vsnprintf(buf, sizeof(buf), fmt, ap2);
+    va_end(ap2);
+    stats_line(buf);
+  }
+  vprintf(fmt, ap);
+}
+
+static void emit(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vemit(fmt, ap);
+  va_end(ap);
+}
+
+// Without a frame pointer the CFA is relative to rsp, so the unwinder
+// has to be told about every change to rsp.
+static void cfi_adjust(int bytes) {
+  if (omit_frame_pointer)
+    emit("  .cfi_adjust_cfa_offset %d\n", bytes);
+}
+
+static void push(char *fmt, ...) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "  push %s\n", fmt);
+
+  va_list ap;
+  va_start(ap, fmt);
+  vemit(buf, ap);
+  va_end(ap);
+  cfi_adjust(8);
+
+  depth++;
+  if (max_depth < depth)
+    max_depth = depth;
+}
+
+static void pop(char *reg) {
+  emit("  pop %s\n", reg);
+  cfi_adjust(-8);
+  depth--;
+}
+
+// Returns the memory operand of a local variable.
+static char *lvar_ref(Var *var) {
+  static char buf[32];
+  if (omit_frame_pointer)
+    sprintf(buf, "[rsp%+d]", frame_top + depth * 8 - var->offset);
+  else
+    sprintf(buf, "[rbp-%d]", var->offset);
+  return buf;
+}
+
+// Globals are addressed relative to rip, so the code works wherever it
+// is loaded. With -fPIC, a global that another module may define is
+// reached through the GOT instead.
+static bool via_got(Var *var) {
+  return pic && !var->is_local && !var->is_static;
+}
 
 // Pushes the given node's address to the stack.
 static void gen_addr(Node *node) {
   switch (node->kind) {
   case ND_VAR:
-    if (node->var->is_local) {
-      //printf("  mov rax, rbp\n");
-      //printf("  sub rax, %d\n", node->var->offset);
-      printf("  lea rax, [rbp-%d]\n", node->var->offset);
-      printf("  push rax\n");
-    } else {
-      printf("  push offset %s\n", node->var->name);
-    }
+    assert(!node->var->reg);
+    if (node->var->is_local)
+      emit("  lea rax, %s\n", lvar_ref(node->var));
+    else if (via_got(node->var))
+      emit("  mov rax, [rip+%s@GOTPCREL]\n", node->var->name);
+    else
+      emit("  lea rax, [rip+%s]\n", node->var->name);
+    push("rax");
     return;
   case ND_DEREF:
     gen(node->lhs);
@@ -26,140 +109,900 @@ static void gen_addr(Node *node) {
   }
 }
 
-static void gen_lval(Node *node) {
-  gen_addr(node);
-}
-
 static void load(Type *ty) {
-  printf("  pop rax\n");
+  pop("rax");
 
   if (ty->size == 1) {
-    printf("  movsx rax, byte ptr [rax]\n");
+    emit("  movsx rax, byte ptr [rax]\n");
   } else if (ty->size == 4) {
-    printf("  movsxd rax, dword ptr [rax]\n");
+    emit("  movsxd rax, dword ptr [rax]\n");
   } else {
     assert(ty->size == 8);
-    printf("  mov rax, [rax]\n");
+    emit("  mov rax, [rax]\n");
+  }
+  push("rax");
+}
+
+// A register variable always holds its value sign-extended to 64 bits,
+// as a load from memory would.
+static void store_reg(Var *var, char *reg1, char *reg4, char *reg8) {
+  if (var->ty->size == 1) {
+    emit("  movsx %s, %s\n", var->reg, reg1);
+  } else if (var->ty->size == 4) {
+    emit("  movsxd %s, %s\n", var->reg, reg4);
+  } else {
+    assert(var->ty->size == 8);
+    emit("  mov %s, %s\n", var->reg, reg8);
+  }
+}
+
+//
+// Instruction selection
+//
+// gen() is a stack machine: every node pushes its value. Many trees map
+// to far fewer instructions than that, so a few patterns are tried
+// first, largest first (maximal munch). A leaf is used in place as an
+// operand instead of being pushed:
+//
+//   leaf                     operand               cost
+//   constant                 5                     0
+//   register variable        rbx                   0
+//   8-byte local in memory   qword ptr [rbp-8]     1 (a load)
+//
+// and the patterns are
+//
+//   x = x + a                add dword ptr [rbp-4], a
+//   *(p + i), p[i] = a       movsxd rax, dword ptr [rax+rdi*4]
+//   p + i                    lea rax, [rax+rdi*4]
+//   a op b                   op rax, b
+//   if (a < b)               cmp rax, b; jge
+//
+// where a and b are leaves. Anything else falls back to the stack
+// machine.
+
+typedef enum {
+  OPD_NONE,
+  OPD_IMM,
+  OPD_REG,
+  OPD_MEM,
+} OperandKind;
+
+static char *reg_names[][3] = {
+  {"rax", "eax", "al"},   {"rdi", "edi", "dil"},  {"rdx", "edx", "dl"},
+  {"rsi", "esi", "sil"},  {"rcx", "ecx", "cl"},   {"r8", "r8d", "r8b"},
+  {"r9", "r9d", "r9b"},   {"r10", "r10d", "r10b"}, {"rbx", "ebx", "bl"},
+  {"r12", "r12d", "r12b"}, {"r13", "r13d", "r13b"}, {"r14", "r14d", "r14b"},
+  {"r15", "r15d", "r15b"},
+};
+
+// Returns the name of the low `size` bytes of a 64-bit register.
+static char *sized_reg(char *reg, int size) {
+  for (int i = 0; i < sizeof(reg_names) / sizeof(*reg_names); i++)
+    if (!strcmp(reg_names[i][0], reg))
+      return reg_names[i][size == 8 ? 0 : size == 4 ? 1 : 2];
+  assert(0);
+}
+
+static char *ptr_size(int size) {
+  return (size == 1) ? "byte" : (size == 4) ? "dword" : "qword";
+}
+
+// A constant as an immediate for a `size`-byte destination
+static int imm_value(int val, int size) {
+  return (size == 1) ? (signed char)val : val;
+}
+
+static bool is_pure(Node *node) {
+  if (!node)
+    return true;
+  if (node->kind == ND_ASSIGN || node->kind == ND_FUNCCALL ||
+      node->kind == ND_SELECT)
+    return false;
+  return is_pure(node->lhs) && is_pure(node->rhs);
+}
+
+static OperandKind operand_kind(Node *node) {
+  if (node->kind == ND_NUM)
+    return OPD_IMM;
+  if (node->kind != ND_VAR || node->ty->kind == TY_ARRAY)
+    return OPD_NONE;
+  if (node->var->reg)
+    return OPD_REG;
+  if (node->var->is_local && node->ty->size == 8)
+    return OPD_MEM;
+  return OPD_NONE;
+}
+
+// Formats a leaf as an operand of an instruction on `size`-byte values.
+// A memory operand depends on the stack depth in -fomit-frame-pointer
+// mode, so it is formatted right before it is used.
+static char *operand(Node *node, int size, char *buf) {
+  switch (operand_kind(node)) {
+  case OPD_IMM:
+    sprintf(buf, "%d", imm_value(node->val, size));
+    break;
+  case OPD_REG:
+    strcpy(buf, sized_reg(node->var->reg, size));
+    break;
+  case OPD_MEM:
+    sprintf(buf, "qword ptr %s", lvar_ref(node->var));
+    break;
+  default:
+    assert(0);
+  }
+  return buf;
+}
+
+// A memory operand [base+index*scale+disp]. The base is a register, a
+// local's slot or a global. A register holding a computed value has been
+// pushed and is popped by pop_address().
+//
+// A global's address is relative to rip, which cannot be indexed.
+typedef struct {
+  char *base;
+  Var *var;
+  char *index;
+  int scale;
+  int disp;
+  bool pushed_base;
+  bool pushed_index;
+} Address;
+
+// Whether a variable can be the base of an Address
+static bool is_direct(Var *var, bool indexed) {
+  return var->is_local || (!indexed && !via_got(var));
+}
+
+static bool is_scale(int size) {
+  return size == 1 || size == 2 || size == 4 || size == 8;
+}
+
+// Evaluates the parts of an address that are not leaves. A register
+// variable is used in place only if nothing evaluated after it, up to
+// `later`, may change it.
+static void gen_address(Node *node, Node *later, Address *am) {
+  *am = (Address){};
+
+  if (node->kind == ND_VAR && node->ty->kind == TY_ARRAY &&
+      is_direct(node->var, false)) {
+    am->var = node->var;
+    return;
+  }
+  if (node->kind == ND_VAR && node->var->reg && is_pure(later)) {
+    am->base = node->var->reg;
+    return;
+  }
+
+  if (node->kind == ND_PTR_ADD && is_scale(node->ty->base->size)) {
+    Node *base = node->lhs;
+    Node *idx = node->rhs;
+    int scale = node->ty->base->size;
+
+    if (base->kind == ND_VAR && base->ty->kind == TY_ARRAY &&
+        is_direct(base->var, idx->kind != ND_NUM)) {
+      am->var = base->var;
+    } else if (base->kind == ND_VAR && base->var->reg && is_pure(idx) &&
+               is_pure(later)) {
+      am->base = base->var->reg;
+    } else {
+      gen(base);
+      am->base = "rax";
+      am->pushed_base = true;
+    }
+
+    if (idx->kind == ND_NUM) {
+      am->disp = idx->val * scale;
+    } else if (idx->kind == ND_VAR && idx->var->reg && is_pure(later)) {
+      am->index = idx->var->reg;
+      am->scale = scale;
+    } else {
+      gen(idx);
+      am->index = "rdi";
+      am->scale = scale;
+      am->pushed_index = true;
+    }
+    return;
   }
-  printf("  push rax\n");
+
+  gen(node);
+  am->base = "rax";
+  am->pushed_base = true;
+}
+
+static void pop_address(Address *am) {
+  if (am->pushed_index)
+    pop("rdi");
+  if (am->pushed_base)
+    pop("rax");
 }
 
-static void store(Type *ty) {
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
+// Formats an address once everything has been popped. The result is
+// valid until the next call.
+static char *address(Address *am) {
+  static char *buf;
+  int len = 64 + (am->var ? strlen(am->var->name) : 0);
+  buf = realloc(buf, len);
+
+  char *base = am->base;
+  int disp = am->disp;
+  if (am->var && am->var->is_local) {
+    if (omit_frame_pointer) {
+      base = "rsp";
+      disp += frame_top + depth * 8 - am->var->offset;
+    } else {
+      base = "rbp";
+      disp -= am->var->offset;
+    }
+  } else if (am->var) {
+    assert(!am->index);
+    if (disp)
+      sprintf(buf, "[rip+%s%+d]", am->var->name, disp);
+    else
+      sprintf(buf, "[rip+%s]", am->var->name);
+    return buf;
+  }
+
+  char *p = buf + sprintf(buf, "[%s", base);
+  if (am->index)
+    p += sprintf(p, "+%s*%d", am->index, am->scale);
+  if (disp)
+    p += sprintf(p, "%+d", disp);
+  strcpy(p, "]");
+  return buf;
+}
 
+// Loads a value of type ty into rax.
+static void load_from(Type *ty, char *mem) {
   if (ty->size == 1) {
-    printf("  mov [rax], dil\n");
+    emit("  movsx rax, byte ptr %s\n", mem);
   } else if (ty->size == 4) {
-    printf("  mov [rax], edi\n");
+    emit("  movsxd rax, dword ptr %s\n", mem);
   } else {
     assert(ty->size == 8);
-    printf("  mov [rax], rdi\n");
+    emit("  mov rax, qword ptr %s\n", mem);
   }
+}
+
+// Evaluates a node into rax.
+static void gen_rax(Node *node) {
+  char buf[48];
+  if (operand_kind(node)) {
+    emit("  mov rax, %s\n", operand(node, 8, buf));
+    return;
+  }
+  if (node->kind == ND_VAR && node->ty->kind != TY_ARRAY &&
+      is_direct(node->var, false)) {
+    Address am = {.var = node->var};
+    load_from(node->ty, address(&am));
+    return;
+  }
+  gen(node);
+  pop("rax");
+}
+
+// Binary operators with a leaf right operand
+typedef struct {
+  NodeKind kind;
+  char *insn;
+  char *cc;  // A comparison's condition code
+  char *ncc; // and its negation
+  bool commutes;
+} BinaryInsn;
+
+static BinaryInsn binary_insns[] = {
+  {ND_ADD, "add", NULL, NULL, true},
+  {ND_SUB, "sub", NULL, NULL, false},
+  {ND_MUL, "imul", NULL, NULL, true},
+  {ND_EQ, "cmp", "e", "ne", true},
+  {ND_NE, "cmp", "ne", "e", true},
+  {ND_LT, "cmp", "l", "ge", false},
+  {ND_LE, "cmp", "le", "g", false},
+};
+
+static BinaryInsn *find_binary(NodeKind kind) {
+  for (int i = 0; i < sizeof(binary_insns) / sizeof(*binary_insns); i++)
+    if (binary_insns[i].kind == kind)
+      return &binary_insns[i];
+  return NULL;
+}
+
+// Emits `op lhs, rhs` with rhs a leaf, swapping the operands of an
+// operator that commutes if only the left one is a leaf. The left
+// operand is in rax unless it is a register variable and the result is
+// not needed. Returns false if neither operand is a leaf.
+static bool gen_binary_insn(Node *node, BinaryInsn *bi, bool in_place) {
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+  if (!operand_kind(rhs) && bi->commutes && operand_kind(lhs) &&
+      is_pure(rhs)) {
+    lhs = node->rhs;
+    rhs = node->lhs;
+  }
+  if (!operand_kind(rhs))
+    return false;
+
+  char *dst = "rax";
+  if (in_place && operand_kind(lhs) == OPD_REG)
+    dst = lhs->var->reg;
+  else
+    gen_rax(lhs);
+
+  char buf[48];
+  emit("  %s %s, %s\n", bi->insn, dst, operand(rhs, 8, buf));
+  return true;
+}
+
+static bool gen_binary(Node *node) {
+  BinaryInsn *bi = find_binary(node->kind);
+  if (!bi || !gen_binary_insn(node, bi, bi->cc))
+    return false;
+  if (bi->cc) {
+    emit("  set%s al\n", bi->cc);
+    emit("  movzb rax, al\n");
+  }
+  push("rax");
+  return true;
+}
 
-  printf("  push rdi\n");
+// Jumps to the label if the condition is `when`.
+static void branch(Node *cond, bool when, char *label, int seq) {
+  BinaryInsn *bi = find_binary(cond->kind);
+  if (bi && bi->cc && gen_binary_insn(cond, bi, true)) {
+    emit("  j%s %s%d\n", when ? bi->cc : bi->ncc, label, seq);
+    return;
+  }
+  gen(cond);
+  pop("rax");
+  emit("  cmp rax, 0\n");
+  emit("  j%s %s%d\n", when ? "ne" : "e", label, seq);
+}
+
+// x = x + a and x = x - a, when the value is not needed
+static bool gen_update(Node *node) {
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+  if (lhs->kind != ND_VAR || (rhs->kind != ND_ADD && rhs->kind != ND_SUB) ||
+      (!lhs->var->reg && !lhs->var->is_local))
+    return false;
+
+  Node *x = rhs->lhs;
+  Node *a = rhs->rhs;
+  if (rhs->kind == ND_ADD && !(x->kind == ND_VAR && x->var == lhs->var)) {
+    x = rhs->rhs;
+    a = rhs->lhs;
+  }
+  if (x->kind != ND_VAR || x->var != lhs->var ||
+      (operand_kind(a) != OPD_IMM && operand_kind(a) != OPD_REG))
+    return false;
+
+  Var *var = lhs->var;
+  int size = var->ty->size;
+  char *insn = (rhs->kind == ND_ADD) ? "add" : "sub";
+  char buf[48];
+  operand(a, size, buf);
+
+  if (!var->reg) {
+    emit("  %s %s ptr %s, %s\n", insn, ptr_size(size), lvar_ref(var), buf);
+    return true;
+  }
+
+  char *reg = sized_reg(var->reg, size);
+  emit("  %s %s, %s\n", insn, reg, buf);
+  if (size == 1)
+    emit("  movsx %s, %s\n", var->reg, reg);
+  else if (size == 4)
+    emit("  movsxd %s, %s\n", var->reg, reg);
+  return true;
+}
+
+// Stores the value of an assignment. With keep set the value is pushed.
+static void gen_assign(Node *node, bool keep) {
+  if (!keep && gen_update(node))
+    return;
+
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+  int size = node->ty->size;
+  char buf[48];
+
+  if (lhs->kind == ND_VAR && lhs->var->reg) {
+    Var *var = lhs->var;
+    if (rhs->kind == ND_NUM) {
+      emit("  mov %s, %d\n", var->reg, imm_value(rhs->val, size));
+      if (keep)
+        push("%d", rhs->val);
+      return;
+    }
+    if (operand_kind(rhs) == OPD_REG) {
+      char *src = rhs->var->reg;
+      if (src != var->reg)
+        store_reg(var, sized_reg(src, 1), sized_reg(src, 4), src);
+      if (keep)
+        push("%s", src);
+      return;
+    }
+    gen(rhs);
+    pop("rdi");
+    store_reg(var, "dil", "edi", "rdi");
+    if (keep)
+      push("rdi");
+    return;
+  }
+
+  Address am;
+  if (lhs->kind == ND_VAR && is_direct(lhs->var, false)) {
+    am = (Address){.var = lhs->var};
+  } else if (lhs->kind == ND_VAR) {
+    gen_addr(lhs);
+    am = (Address){.base = "rax", .pushed_base = true};
+  } else {
+    gen_address(lhs->lhs, rhs, &am);
+  }
+
+  char *value;
+  if (rhs->kind == ND_NUM) {
+    sprintf(buf, "%d", imm_value(rhs->val, size));
+    value = buf;
+  } else if (operand_kind(rhs) == OPD_REG) {
+    value = sized_reg(rhs->var->reg, size);
+  } else {
+    gen(rhs);
+    pop("rdx");
+    value = sized_reg("rdx", size);
+  }
+  pop_address(&am);
+
+  emit("  mov %s ptr %s, %s\n", ptr_size(size), address(&am), value);
+
+  if (!keep)
+    return;
+  if (rhs->kind == ND_NUM)
+    push("%d", rhs->val);
+  else if (operand_kind(rhs) == OPD_REG)
+    push("%s", rhs->var->reg);
+  else
+    push("rdx");
+}
+
+// Callee-saved registers that hold variables are kept in slots of their
+// own. `cfa` is the offset of the slot from the CFA.
+static int save_slot_cfa(Var *var) {
+  if (omit_frame_pointer)
+    return frame_top - var->offset - 8 - frame_size;
+  return -16 - var->offset;
+}
+
+static void save_regs(Function *fn) {
+  for (Var *var = fn->locals; var; var = var->next) {
+    if (var->saved_reg) {
+      emit("  mov %s, %s\n", lvar_ref(var), var->saved_reg);
+      emit("  .cfi_offset %s, %d\n", var->saved_reg, save_slot_cfa(var));
+    }
+  }
+}
+
+static void restore_regs(Function *fn) {
+  for (Var *var = fn->locals; var; var = var->next) {
+    if (var->saved_reg) {
+      emit("  mov %s, %s\n", var->saved_reg, lvar_ref(var));
+      emit("  .cfi_restore %s\n", var->saved_reg);
+    }
+  }
+}
+
+// A call in tail position can reuse the caller's frame only if nothing
+// may still point into it.
+static bool can_tail_call(Node *node) {
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    nargs++;
+  if (nargs > 6)
+    return false;
+
+  for (Var *var = current_fn->locals; var; var = var->next)
+    if (var->addr_taken)
+      return false;
+  return true;
+}
+
+// -fprofile-generate: bumps counter k of a branch or call node.
+// inc leaves every register alone. Loops the optimizer made have no
+// counters.
+static void count_edge(Node *node, int k) {
+  if (profile_generate && node->prof_id)
+    emit("  inc qword ptr [rip+.L.pgo.%s+%d]\n", funcname,
+         (node->prof_id + k) * 8);
+}
+
+// With a profile, the then-block of an if that is seldom true is
+// emitted after the function body, out of the hot path. Statements run
+// at depth 0, as does the end of the body, so the stack layout matches.
+typedef struct {
+  Node *node;
+  int seq;
+} ColdBlock;
+
+static ColdBlock *cold;
+static int ncold;
+
+static void defer_cold(Node *node, int seq) {
+  cold = realloc(cold, sizeof(ColdBlock) * (ncold + 1));
+  cold[ncold++] = (ColdBlock){node, seq};
+}
+
+// -finstrument
+//
+// Each function has a 16-byte .bss entry holding its call count and the
+// cycles spent in it, callees included. A destructor appends the table
+// to 9cc.prof when the program exits.
+static char **prof_fns;
+static int nprof_fns;
+
+// Reads the TSC into rax. rdx is clobbered.
+static void emit_rdtsc(void) {
+  emit("  rdtsc\n");
+  emit("  shl rdx, 32\n");
+  emit("  or rax, rdx\n");
+}
+
+// Runs after the arguments have been stored, since rdtsc clobbers rdx.
+static void prof_enter(Function *fn) {
+  emit("  inc qword ptr [rip+.L.prof.%s]\n", fn->name);
+  emit_rdtsc();
+  emit("  mov %s, rax\n", lvar_ref(fn->prof_start));
+}
+
+// The return value is kept in r11 so that nothing is pushed; a leaf
+// function's locals may be in the red zone just below rsp.
+static void prof_leave(Function *fn) {
+  emit("  mov r11, rax\n");
+  emit_rdtsc();
+  emit("  sub rax, %s\n", lvar_ref(fn->prof_start));
+  emit("  add [rip+.L.prof.%s+8], rax\n", fn->name);
+  emit("  mov rax, r11\n");
+}
+
+// `return f(...)` is emitted as a jump instead of a call.
+// Self-recursion loops back to just after the prologue, and any other
+// callee takes over our return address after the frame is torn down.
+static void gen_tail_call(Node *node) {
+  count_edge(node, 0);
+
+  int nargs = 0;
+  for (Node *arg = node->args; arg; arg = arg->next) {
+    gen(arg);
+    nargs++;
+  }
+
+  // The epilogue is skipped, so the cycles are accounted here, before
+  // rdtsc can clobber rdx. They do not include the callee.
+  if (instrument)
+    prof_leave(current_fn);
+
+  for (int i = 0; i <= nargs - 1; i++)
+    pop(argreg8[i]);
+
+  // The code after the jump still has the frame.
+  emit("  .cfi_remember_state\n");
+  restore_regs(current_fn);
+  if (omit_frame_pointer) {
+    if (frame_size) {
+      emit("  add rsp, %d\n", frame_size);
+      cfi_adjust(-frame_size);
+    }
+  } else {
+    emit("  mov rsp, rbp\n");
+  }
+
+  if (!strcmp(node->funcname, funcname)) {
+    emit("  jmp .L.tail.%s\n", funcname);
+  } else {
+    if (!omit_frame_pointer) {
+      emit("  pop rbp\n");
+      emit("  .cfi_def_cfa rsp, 8\n");
+    }
+    emit("  mov rax, 0\n");
+    emit("  jmp %s@PLT\n", node->funcname);
+  }
+  emit("  .cfi_restore_state\n");
+}
+
+// A vectorized loop handles 16 bytes of its arrays per iteration with
+// SSE2. The xmm registers are free since nothing in it is a call.
+static void gen_vector_loop(Node *node) {
+  int seq = labelseq++;
+  char *sfx = (node->ty->size == 1) ? "b" : "d";
+
+  if (node->var)
+    emit("  pxor xmm2, xmm2\n");
+  emit(".Lvbegin%d:\n", seq);
+  branch(node->cond, false, ".Lvend", seq);
+
+  bool binary = node->args->next;
+  for (Node *arg = node->args; arg; arg = arg->next)
+    gen(arg);
+  if (node->lhs) {
+    gen(node->lhs);
+    pop("rax");
+  }
+  if (binary)
+    pop("rdx");
+  pop("rdi");
+
+  emit("  movdqu xmm0, [rdi]\n");
+  if (binary)
+    emit("  movdqu xmm1, [rdx]\n");
+
+  switch (node->val) {
+  case ND_ADD:
+    if (binary)
+      emit("  padd%s xmm0, xmm1\n", sfx);
+    break;
+  case ND_SUB:
+    emit("  psub%s xmm0, xmm1\n", sfx);
+    break;
+  case ND_EQ:
+    // All ones where equal, and 0 - (-1) is 1.
+    emit("  pcmpeq%s xmm0, xmm1\n", sfx);
+    emit("  pxor xmm1, xmm1\n");
+    emit("  psub%s xmm1, xmm0\n", sfx);
+    emit("  movdqa xmm0, xmm1\n");
+    break;
+  }
+
+  if (node->var)
+    emit("  paddd xmm2, xmm0\n");
+  else
+    emit("  movdqu [rax], xmm0\n");
+
+  gen(node->inc);
+  emit("  jmp .Lvbegin%d\n", seq);
+  emit(".Lvend%d:\n", seq);
+
+  if (node->var) {
+    emit("  pshufd xmm0, xmm2, 0x4e\n");
+    emit("  paddd xmm2, xmm0\n");
+    emit("  pshufd xmm0, xmm2, 0xb1\n");
+    emit("  paddd xmm2, xmm0\n");
+    emit("  movd eax, xmm2\n");
+    emit("  movsxd rax, eax\n");
+    if (node->var->reg)
+      store_reg(node->var, "al", "eax", "rax");
+    else
+      emit("  mov %s, rax\n", lvar_ref(node->var));
+    gen(node->init);
+  }
+}
+
+// -g: statements are mapped back to their source lines.
+static void emit_loc(Node *node) {
+  switch (node->kind) {
+  case ND_RETURN:
+  case ND_IF:
+  case ND_WHILE:
+  case ND_FOR:
+  case ND_EXPR_STMT:
+    emit("  .loc 1 %d %d\n", node->line, node->col);
+  }
+}
+
+// A loop whose condition is true more often than not is rotated: the
+// condition moves below the body, so each iteration takes a single
+// conditional branch back to the top.
+static bool loop_is_hot(Node *node) {
+  long evals, taken;
+  return branch_counts(current_fn, node, &evals, &taken) &&
+         taken > evals - taken;
 }
 
 void gen(Node *node) {
+  if (debug_info)
+    emit_loc(node);
+
   if (node->kind == ND_NULL) {
     return;
+  } else if (node->kind == ND_VLOOP) {
+    gen_vector_loop(node);
+    return;
+  } else if (node->kind == ND_EXPR_STMT) {
+    if (node->lhs->kind == ND_ASSIGN) {
+      gen_assign(node->lhs, false);
+      return;
+    }
+    gen(node->lhs);
+    emit("  add rsp, 8\n");
+    cfi_adjust(-8);
+    depth--;
+    return;
   } else if (node->kind == ND_RETURN) {
-    if (node->rhs) {
-      gen(node->rhs);
-      printf("  pop rax\n");
+    if (node->rhs && node->rhs->kind == ND_FUNCCALL &&
+        can_tail_call(node->rhs)) {
+      gen_tail_call(node->rhs);
+      return;
     }
-    printf("  jmp .L.return.%s\n", funcname);
+    if (node->rhs)
+      gen_rax(node->rhs);
+    emit("  jmp .L.return.%s\n", funcname);
     return;
   } else if (node->kind == ND_NUM) {
-    printf("  push %d\n", node->val);
+    push("%d", node->val);
     return;
   } else if (node->kind == ND_VAR) {
-    gen_addr(node);
-    if (node->ty->kind != TY_ARRAY)
+    if (node->var->reg) {
+      push("%s", node->var->reg);
+      return;
+    }
+    if (node->ty->kind == TY_ARRAY) {
+      gen_addr(node);
+      return;
+    }
+    if (!is_direct(node->var, false)) {
+      gen_addr(node);
       load(node->ty);
+      return;
+    }
+    Address am = {.var = node->var};
+    if (node->ty->size == 8) {
+      push("qword ptr %s", address(&am));
+      return;
+    }
+    load_from(node->ty, address(&am));
+    push("rax");
     return;
   } else if (node->kind == ND_FUNCCALL) {
+    count_edge(node, 0);
+
     int nargs = 0;
+    bool leaves = true;
     for (Node *arg = node->args; arg; arg = arg->next) {
-      gen(arg);
+      leaves = leaves && operand_kind(arg);
       nargs++;
     }
 
-    // c->b->aの順でstackに積むので
-    // 第1引数から順にa->b->cとなるように下ろす
-    for (int i = 0; i <= nargs - 1; i++)
-      printf("  pop %s\n", argreg8[i]);
-
-    printf("  mov rax, rsp\n");
-    printf("  and rax, 15\n");
-    printf("  jnz .L.call.%d\n", labelseq);
-    printf("  mov rax, 0\n");
-    printf("  call %s\n", node->funcname);
-    printf("  jmp .L.end.%d\n", labelseq);
-    printf(".L.call.%d:\n", labelseq);
-    printf("  sub rsp, 8\n");
-    printf("  mov rax, 0\n");
-    printf("  call %s\n", node->funcname);
-    printf("  add rsp, 8\n");
-    printf(".L.end.%d:\n", labelseq);
-    printf("  push rax\n");
-    labelseq++;
+    if (leaves) {
+      // Arguments that are leaves go straight to their registers.
+      // Register variables are never argument registers here since
+      // this function makes calls.
+      char buf[48];
+      int i = nargs;
+      for (Node *arg = node->args; arg; arg = arg->next)
+        emit("  mov %s, %s\n", argreg8[--i], operand(arg, 8, buf));
+    } else {
+      for (Node *arg = node->args; arg; arg = arg->next)
+        gen(arg);
+
+      // c->b->aの順でstackに積むので
+      // 第1引数から順にa->b->cとなるように下ろす
+      for (int i = 0; i <= nargs - 1; i++)
+        pop(argreg8[i]);
+    }
+
+    has_call = true;
+
+    // Without a frame pointer the stack depth is known here, and so is
+    // the alignment of rsp.
+    if (omit_frame_pointer) {
+      bool pad = (8 + frame_size + depth * 8) % 16;
+      if (pad) {
+        emit("  sub rsp, 8\n");
+        cfi_adjust(8);
+      }
+      emit("  mov rax, 0\n");
+      emit("  call %s@PLT\n", node->funcname);
+      if (pad) {
+        emit("  add rsp, 8\n");
+        cfi_adjust(-8);
+      }
+      push("rax");
+      return;
+    }
+
+    int seq = labelseq++;
+    emit("  mov rax, rsp\n");
+    emit("  and rax, 15\n");
+    emit("  jnz .L.call.%d\n", seq);
+    emit("  mov rax, 0\n");
+    emit("  call %s@PLT\n", node->funcname);
+    emit("  jmp .L.end.%d\n", seq);
+    emit(".L.call.%d:\n", seq);
+    emit("  sub rsp, 8\n");
+    emit("  mov rax, 0\n");
+    emit("  call %s@PLT\n", node->funcname);
+    emit("  add rsp, 8\n");
+    emit(".L.end.%d:\n", seq);
+    push("rax");
     return;
   } else if (node->kind == ND_ASSIGN) {
-    gen_lval(node->lhs);
-    gen(node->rhs);
-    store(node->ty);
+    gen_assign(node, true);
     return;
   } else if (node->kind == ND_WHILE) {
-    printf(".Lbegin%d:\n", labelseq);
-    gen(node->cond);
-    printf("  pop rax\n");
-    printf("  cmp rax, 0\n");
-    printf("  je .Lend%d\n", labelseq);
+    int seq = labelseq++;
+    if (loop_is_hot(node)) {
+      emit("  jmp .Lcond%d\n", seq);
+      emit(".Lbegin%d:\n", seq);
+      count_edge(node, 1);
+      gen(node->then);
+      emit(".Lcond%d:\n", seq);
+      count_edge(node, 0);
+      branch(node->cond, true, ".Lbegin", seq);
+      return;
+    }
+    emit(".Lbegin%d:\n", seq);
+    count_edge(node, 0);
+    branch(node->cond, false, ".Lend", seq);
+    count_edge(node, 1);
     gen(node->then);
-    printf("  jmp .Lbegin%d\n", labelseq);
-    printf(".Lend%d:\n", labelseq);
-    labelseq++;
+    emit("  jmp .Lbegin%d\n", seq);
+    emit(".Lend%d:\n", seq);
     return;
   } else if (node->kind == ND_FOR ) {
+    int seq = labelseq++;
     if(node->init) {
       gen(node->init);
     }
-    printf(".Lbegin%d:\n", labelseq);
-    if(node->cond){
-      gen(node->cond);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  je .Lend%d\n", labelseq);
+    if (node->cond && loop_is_hot(node)) {
+      emit("  jmp .Lcond%d\n", seq);
+      emit(".Lbegin%d:\n", seq);
+      count_edge(node, 1);
+      if (node->inc)
+        gen(node->inc);
+      gen(node->then);
+      emit(".Lcond%d:\n", seq);
+      count_edge(node, 0);
+      branch(node->cond, true, ".Lbegin", seq);
+      return;
     }
+    emit(".Lbegin%d:\n", seq);
+    count_edge(node, 0);
+    if(node->cond)
+      branch(node->cond, false, ".Lend", seq);
+    count_edge(node, 1);
     if(node->inc){
       gen(node->inc);
     }
     gen(node->then);
-    printf("  jmp .Lbegin%d\n", labelseq);
-    printf(".Lend%d:\n", labelseq);
-    labelseq++;
+    emit("  jmp .Lbegin%d\n", seq);
+    emit(".Lend%d:\n", seq);
     return;
   } else if (node->kind == ND_IF ) {
+    int seq = labelseq++;
+    long evals, taken;
+    bool mostly_false = branch_counts(current_fn, node, &evals, &taken) &&
+                        taken < evals - taken;
+
+    count_edge(node, 0);
+
+    if (mostly_false) {
+      // Let the false path fall through.
+      branch(node->cond, true, ".Lthen", seq);
+      if (!node->els) {
+        defer_cold(node, seq);
+        emit(".Lend%d:\n", seq);
+        return;
+      }
+      gen(node->els);
+      emit("  jmp .Lend%d\n", seq);
+      emit(".Lthen%d:\n", seq);
+      count_edge(node, 1);
+      gen(node->then);
+      emit(".Lend%d:\n", seq);
+      return;
+    }
+
     if(node->els){
-      gen(node->cond);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  je .Lelse%d\n", labelseq);
+      branch(node->cond, false, ".Lelse", seq);
+      count_edge(node, 1);
       gen(node->then);
-      printf("  jmp .Lend%d\n", labelseq);
-      printf(".Lelse%d:\n", labelseq);
+      emit("  jmp .Lend%d\n", seq);
+      emit(".Lelse%d:\n", seq);
       gen(node->els);
-      printf(".Lend%d:\n", labelseq);
+      emit(".Lend%d:\n", seq);
     } else {
-      gen(node->cond);
-      printf("  pop rax\n");
-      printf("  cmp rax, 0\n");
-      printf("  je .Lend%d\n", labelseq);
+      branch(node->cond, false, ".Lend", seq);
+      count_edge(node, 1);
       gen(node->then);
-      printf(".Lend%d:\n", labelseq);
+      emit(".Lend%d:\n", seq);
     }
-    labelseq++;
     return;
   } else if (node->kind == ND_BLOCK) {
     for(Node* n = node->body; n; n = n->next)
@@ -168,150 +1011,539 @@ void gen(Node *node) {
   } else if (node->kind == ND_ADDR) {
     gen_addr(node->lhs);
     return;
+  } else if (node->kind == ND_SELECT) {
+    gen(node->cond);
+    gen(node->then);
+    gen(node->els);
+    pop("rdi");
+    pop("rax");
+    pop("rdx");
+    emit("  cmp rdx, 0\n");
+    emit("  cmove rax, rdi\n");
+    push("rax");
+    return;
+  } else if (node->kind == ND_DEREF && node->ty->kind != TY_ARRAY) {
+    Address am;
+    gen_address(node->lhs, NULL, &am);
+    pop_address(&am);
+    load_from(node->ty, address(&am));
+    push("rax");
+    return;
   } else if (node->kind == ND_DEREF) {
     gen(node->lhs);
     load(node->ty);
     return;
+  } else if (node->kind == ND_PTR_ADD && is_scale(node->ty->base->size)) {
+    Address am;
+    gen_address(node, NULL, &am);
+    pop_address(&am);
+    emit("  lea rax, %s\n", address(&am));
+    push("rax");
+    return;
   }
 
+  if (gen_binary(node))
+    return;
+
   gen(node->lhs);
   gen(node->rhs);
 
-  printf("  pop rdi\n");
-  printf("  pop rax\n");
+  pop("rdi");
+  pop("rax");
 
   switch (node->kind) {
     case ND_ADD:
-      printf("  add rax, rdi\n");
+      emit("  add rax, rdi\n");
       break;
     case ND_PTR_ADD:
-      printf("  imul rdi, %d\n", node->ty->base->size);
-      printf("  add rax, rdi\n");
+      emit("  imul rdi, %d\n", node->ty->base->size);
+      emit("  add rax, rdi\n");
       break;
     case ND_SUB:
-      printf("  sub rax, rdi\n");
+      emit("  sub rax, rdi\n");
       break;
     case ND_PTR_SUB:
-      printf("  imul rdi, %d\n", node->ty->base->size);
-      printf("  sub rax, rdi\n");
+      emit("  imul rdi, %d\n", node->ty->base->size);
+      emit("  sub rax, rdi\n");
       break;
     case ND_PTR_DIFF:
-      printf("  sub rax, rdi\n");
-      printf("  cqo\n");
-      printf("  mov rdi, %d\n", node->lhs->ty->base->size);
-      printf("  idiv rdi\n");
+      emit("  sub rax, rdi\n");
+      emit("  cqo\n");
+      emit("  mov rdi, %d\n", node->lhs->ty->base->size);
+      emit("  idiv rdi\n");
     case ND_MUL:
-      printf("  imul rax, rdi\n");
+      emit("  imul rax, rdi\n");
       break;
     case ND_DIV:
-      printf("  cqo\n");
-      printf("  idiv rdi\n");
+      emit("  cqo\n");
+      emit("  idiv rdi\n");
       break;
     case ND_EQ:
-      printf("  cmp rax, rdi\n");
-      printf("  sete al\n");
-      printf("  movzb rax, al\n");
+      emit("  cmp rax, rdi\n");
+      emit("  sete al\n");
+      emit("  movzb rax, al\n");
       break;
     case ND_NE:
-      printf("  cmp rax, rdi\n");
-      printf("  setne al\n");
-      printf("  movzb rax, al\n");
+      emit("  cmp rax, rdi\n");
+      emit("  setne al\n");
+      emit("  movzb rax, al\n");
       break;
     case ND_LT:
-      printf("  cmp rax, rdi\n");
-      printf("  setl al\n");
-      printf("  movzb rax, al\n");
+      emit("  cmp rax, rdi\n");
+      emit("  setl al\n");
+      emit("  movzb rax, al\n");
       break;
     case ND_LE:
-      printf("  cmp rax, rdi\n");
-      printf("  setle al\n");
-      printf("  movzb rax, al\n");
+      emit("  cmp rax, rdi\n");
+      emit("  setle al\n");
+      emit("  movzb rax, al\n");
       break;
   }
 
-  printf("  push rax\n");
+  push("rax");
 }
 
-static void emit_data(Program *prog) {
-  for (Var *vl = prog->globals; vl; vl = vl->next)
-    if (!vl->is_static)
-      printf(".global %s\n", vl->name);
+// Compares two string literals back to front, so that a literal sorts
+// right before any longer literal it is a suffix of.
+static int cmp_suffix(const void *x, const void *y) {
+  Var *a = *(Var **)x;
+  Var *b = *(Var **)y;
+  int i = a->ty->size - 2;
+  int j = b->ty->size - 2;
+  for (; i >= 0 && j >= 0; i--, j--)
+    if (a->init_data[i] != b->init_data[j])
+      return (unsigned char)a->init_data[i] - (unsigned char)b->init_data[j];
+  return a->ty->size - b->ty->size;
+}
+
+static bool is_suffix(Var *a, Var *b) {
+  int off = b->ty->size - a->ty->size;
+  return off >= 0 &&
+         !memcmp(a->init_data, b->init_data + off, a->ty->size - 1);
+}
+
+static void emit_string(char *p, int len) {
+  emit("  .string \"");
+  for (int i = 0; i < len; i++) {
+    unsigned char c = p[i];
+    if (c == '"' || c == '\\')
+      emit("\\%c", c);
+    else if (isprint(c))
+      emit("%c", c);
+    else
+      emit("\\%03o", c);
+  }
+  emit("\"\n");
+}
+
+// String literals go to .rodata. A literal that is a suffix of another
+// one is not emitted at all but defined as an address inside it.
+static void emit_strings(Var *globals) {
+  int n = 0;
+  for (Var *vl = globals; vl; vl = vl->next)
+    if (vl->init_data)
+      n++;
+  if (n == 0)
+    return;
+
+  Var **strs = calloc(n, sizeof(Var *));
+  int i = 0;
+  for (Var *vl = globals; vl; vl = vl->next)
+    if (vl->init_data)
+      strs[i++] = vl;
+  qsort(strs, n, sizeof(Var *), cmp_suffix);
 
-  printf(".bss\n");
+  emit(".section .rodata\n");
 
-  for (Var *vl = prog->globals; vl; vl = vl->next) {
-    if (vl->initializer)
+  for (int i = n - 1; i >= 0; i--) {
+    Var *var = strs[i];
+    if (i + 1 < n && is_suffix(var, strs[i + 1])) {
+      // Point into the longer literal, which has already been defined.
+      emit(".set %s, %s+%d\n", var->name, strs[i + 1]->name,
+           strs[i + 1]->ty->size - var->ty->size);
       continue;
+    }
 
-    printf(".align %d\n", vl->ty->align);
-    printf("%s:\n", vl->name);
-    if(vl->ty->size != 0)
-      printf("  .zero %d\n", vl->ty->size);
+    emit("%s:\n", var->name);
+    emit_string(var->init_data, var->ty->size - 1);
+    stats_data(var->ty->size);
   }
+  free(strs);
+}
 
-  printf(".data\n");
+static void emit_data(Var *globals) {
+  for (Var *vl = globals; vl; vl = vl->next)
+    if (!vl->is_static)
+      emit(".global %s\n", vl->name);
 
-  for (Var *vl = prog->globals; vl; vl = vl->next) {
-    if (!vl->initializer)
-      continue;
+  emit(".bss\n");
 
-    printf(".align %d\n", vl->ty->align);
-    printf("%s:\n", vl->name);
+  for (Var *vl = globals; vl; vl = vl->next) {
+    if (vl->init_data)
+      continue;
 
-    for (Initializer *init = vl->initializer; init; init = init->next) {
-      if (init->sz == 1)
-        printf("  .byte %ld\n", init->val);
-      else
-        printf("  .%dbyte %ld\n", init->sz, init->val);
-    }
+    emit(".align %d\n", vl->ty->align);
+    emit("%s:\n", vl->name);
+    if(vl->ty->size != 0)
+      emit("  .zero %d\n", vl->ty->size);
+    stats_data(vl->ty->size);
   }
+
+  emit_strings(globals);
 }
 
 void load_arg(Var *var, int idx) {
+  if (var->reg) {
+    store_reg(var, argreg1[idx], argreg4[idx], argreg8[idx]);
+    return;
+  }
+
   int sz = var->ty->size;
   if (sz == 1) {
-    printf("  mov [rbp-%d], %s\n", var->offset, argreg1[idx]);
+    emit("  mov %s, %s\n", lvar_ref(var), argreg1[idx]);
   } else if (sz == 4) {
     // int
-    printf("  mov [rbp-%d], %s\n", var->offset, argreg4[idx]);
+    emit("  mov %s, %s\n", lvar_ref(var), argreg4[idx]);
   } else {
     assert(sz == 8);
-    printf("  mov [rbp-%d], %s\n", var->offset, argreg8[idx]);
+    emit("  mov %s, %s\n", lvar_ref(var), argreg8[idx]);
   }
 }
 
-void emit_text(Program *prog) {
-  printf(".text\n");
+static void emit_prof_table(void) {
+  if (nprof_fns == 0)
+    return;
 
-  for (Function *fn = prog->fns; fn; fn = fn->next) {
-    printf(".global %s\n", fn->name);
-    printf("%s:\n", fn->name);
-    funcname = fn->name;
+  emit(".bss\n");
+  emit(".align 8\n");
+  for (int i = 0; i < nprof_fns; i++) {
+    emit(".L.prof.%s:\n", prof_fns[i]);
+    emit("  .zero 16\n");
+  }
 
-    // Prologue
-    printf("  push rbp\n");
-    printf("  mov rbp, rsp\n");
-    printf("  sub rsp, %d\n", fn->stack_size);
+  emit(".section .rodata\n");
+  emit(".L.prof.path:\n");
+  emit("  .string \"9cc.prof\"\n");
+  emit(".L.prof.mode:\n");
+  emit("  .string \"a\"\n");
+  emit(".L.prof.fmt:\n");
+  emit("  .string \"%%s %%ld %%ld\\n\"\n");
+  for (int i = 0; i < nprof_fns; i++) {
+    emit(".L.prof.name.%s:\n", prof_fns[i]);
+    emit("  .string \"%s\"\n", prof_fns[i]);
+  }
 
-    // Push arguments to the stack
-    int i = 0;
-    for (Var *lv = fn->params; lv; lv = lv->next)
-      load_arg(lv, i++);
+  // The destructor. rbx holds the FILE * and keeps rsp aligned.
+  emit(".text\n");
+  emit(".L.prof.dump:\n");
+  emit("  .cfi_startproc\n");
+  emit("  push rbx\n");
+  emit("  .cfi_adjust_cfa_offset 8\n");
+  emit("  lea rdi, [rip+.L.prof.path]\n");
+  emit("  lea rsi, [rip+.L.prof.mode]\n");
+  emit("  call fopen@PLT\n");
+  emit("  test rax, rax\n");
+  emit("  jz .L.prof.done\n");
+  emit("  mov rbx, rax\n");
+  for (int i = 0; i < nprof_fns; i++) {
+    emit("  mov rdi, rbx\n");
+    emit("  lea rsi, [rip+.L.prof.fmt]\n");
+    emit("  lea rdx, [rip+.L.prof.name.%s]\n", prof_fns[i]);
+    emit("  mov rcx, [rip+.L.prof.%s]\n", prof_fns[i]);
+    emit("  mov r8, [rip+.L.prof.%s+8]\n", prof_fns[i]);
+    emit("  mov eax, 0\n");
+    emit("  call fprintf@PLT\n");
+  }
+  emit("  mov rdi, rbx\n");
+  emit("  call fclose@PLT\n");
+  emit(".L.prof.done:\n");
+  emit("  pop rbx\n");
+  emit("  .cfi_adjust_cfa_offset -8\n");
+  emit("  ret\n");
+  emit("  .cfi_endproc\n");
+
+  emit(".section .fini_array,\"aw\"\n");
+  emit(".align 8\n");
+  emit("  .quad .L.prof.dump\n");
+}
+
+// -fprofile-generate: the counter tables, and a destructor that appends
+// them to 9cc.pgo. See profile.c for the format.
+typedef struct {
+  char *name;
+  int n;
+} PgoFunc;
+
+static PgoFunc *pgo_fns;
+static int npgo_fns;
+
+static void emit_pgo_table(void) {
+  if (npgo_fns == 0)
+    return;
 
-      // Emit code
-      for (Node *node = fn->node; node; node =node->next)
-        gen(node);
+  emit(".bss\n");
+  emit(".align 8\n");
+  for (int i = 0; i < npgo_fns; i++) {
+    emit(".L.pgo.%s:\n", pgo_fns[i].name);
+    emit("  .zero %d\n", pgo_fns[i].n * 8);
+  }
+
+  emit(".section .rodata\n");
+  emit(".L.pgo.path:\n");
+  emit("  .string \"9cc.pgo\"\n");
+  emit(".L.pgo.mode:\n");
+  emit("  .string \"a\"\n");
+  emit(".L.pgo.head:\n");
+  emit("  .string \"%%s %%d\"\n");
+  emit(".L.pgo.count:\n");
+  emit("  .string \" %%ld\"\n");
+  emit(".L.pgo.newline:\n");
+  emit("  .string \"\\n\"\n");
+  for (int i = 0; i < npgo_fns; i++) {
+    emit(".L.pgo.name.%s:\n", pgo_fns[i].name);
+    emit("  .string \"%s\"\n", pgo_fns[i].name);
+  }
 
-      // Epilogue
-      printf(".L.return.%s:\n", funcname);
-      printf("  mov rsp, rbp\n");
-      printf("  pop rbp\n");
-      printf("  ret\n");
+  // rbx holds the FILE *, and r12 walks a table up to r13. Three pushes
+  // keep rsp aligned.
+  emit(".text\n");
+  emit(".L.pgo.dump:\n");
+  emit("  .cfi_startproc\n");
+  emit("  push rbx\n");
+  emit("  push r12\n");
+  emit("  push r13\n");
+  emit("  .cfi_adjust_cfa_offset 24\n");
+  emit("  lea rdi, [rip+.L.pgo.path]\n");
+  emit("  lea rsi, [rip+.L.pgo.mode]\n");
+  emit("  call fopen@PLT\n");
+  emit("  test rax, rax\n");
+  emit("  jz .L.pgo.done\n");
+  emit("  mov rbx, rax\n");
+  for (int i = 0; i < npgo_fns; i++) {
+    char *name = pgo_fns[i].name;
+    emit("  mov rdi, rbx\n");
+    emit("  lea rsi, [rip+.L.pgo.head]\n");
+    emit("  lea rdx, [rip+.L.pgo.name.%s]\n", name);
+    emit("  mov ecx, %d\n", pgo_fns[i].n);
+    emit("  mov eax, 0\n");
+    emit("  call fprintf@PLT\n");
+    emit("  lea r12, [rip+.L.pgo.%s]\n", name);
+    emit("  lea r13, [rip+.L.pgo.%s+%d]\n", name, pgo_fns[i].n * 8);
+    emit(".L.pgo.loop.%s:\n", name);
+    emit("  mov rdi, rbx\n");
+    emit("  lea rsi, [rip+.L.pgo.count]\n");
+    emit("  mov rdx, [r12]\n");
+    emit("  mov eax, 0\n");
+    emit("  call fprintf@PLT\n");
+    emit("  add r12, 8\n");
+    emit("  cmp r12, r13\n");
+    emit("  jne .L.pgo.loop.%s\n", name);
+    emit("  mov rdi, rbx\n");
+    emit("  lea rsi, [rip+.L.pgo.newline]\n");
+    emit("  mov eax, 0\n");
+    emit("  call fprintf@PLT\n");
   }
+  emit("  mov rdi, rbx\n");
+  emit("  call fclose@PLT\n");
+  emit(".L.pgo.done:\n");
+  emit("  pop r13\n");
+  emit("  pop r12\n");
+  emit("  pop rbx\n");
+  emit("  .cfi_adjust_cfa_offset -24\n");
+  emit("  ret\n");
+  emit("  .cfi_endproc\n");
+
+  emit(".section .fini_array,\"aw\"\n");
+  emit(".align 8\n");
+  emit("  .quad .L.pgo.dump\n");
+}
+
+static void gen_body(Function *fn) {
+  depth = 0;
+  max_depth = 0;
+  has_call = false;
+  ncold = 0;
+
+  save_regs(fn);
+
+  int i = 0;
+  for (Var *lv = fn->params; lv; lv = lv->next)
+    load_arg(lv, i++);
+
+  if (instrument)
+    prof_enter(fn);
+  if (profile_generate)
+    emit("  inc qword ptr [rip+.L.pgo.%s]\n", fn->name);
+
+  for (Node *node = fn->node; node; node = node->next)
+    gen(node);
+
+  // Cold blocks may defer more cold blocks.
+  if (ncold)
+    emit("  jmp .L.return.%s\n", fn->name);
+  for (int i = 0; i < ncold; i++) {
+    ColdBlock cb = cold[i];
+    emit(".Lthen%d:\n", cb.seq);
+    count_edge(cb.node, 1);
+    gen(cb.node->then);
+    emit("  jmp .Lend%d\n", cb.seq);
+  }
+  assert(depth == 0);
+}
+
+// Decides the frame of a function compiled without a frame pointer.
+// The body is generated once without output to learn how deep the
+// expression stack gets and whether anything is called. A leaf
+// function whose locals and temporaries fit in the 128-byte red zone
+// below rsp does not move rsp at all: temporaries are pushed right
+// below the return address and locals live under them.
+static void layout_frame(Function *fn) {
+  frame_size = fn->stack_size;
+  frame_top = fn->stack_size;
+  if (fn->stack_size == 0)
+    return;
+
+  int seq = labelseq;
+  dry_run = true;
+  gen_body(fn);
+  dry_run = false;
+  labelseq = seq;
+
+  if (!has_call && fn->stack_size + max_depth * 8 <= 128) {
+    frame_size = 0;
+    frame_top = -max_depth * 8;
+  }
+}
+
+static void emit_function(Function *fn) {
+  emit(".global %s\n", fn->name);
+  // gprof only attributes samples to function symbols.
+  emit(".type %s, @function\n", fn->name);
+  emit("%s:\n", fn->name);
+  emit("  .cfi_startproc\n");
+  if (debug_info)
+    emit("  .loc 1 %d\n", fn->line);
+  funcname = fn->name;
+  current_fn = fn;
+  if (codegen_stats)
+    stats_begin_function(fn->name);
+
+  // Prologue
+  if (omit_frame_pointer) {
+    layout_frame(fn);
+    emit(".L.tail.%s:\n", funcname);
+    if (frame_size) {
+      emit("  sub rsp, %d\n", frame_size);
+      cfi_adjust(frame_size);
+    }
+  } else {
+    emit("  push rbp\n");
+    emit("  .cfi_def_cfa_offset 16\n");
+    emit("  .cfi_offset rbp, -16\n");
+    emit("  mov rbp, rsp\n");
+    emit("  .cfi_def_cfa_register rbp\n");
+    if (profile_mcount)
+      emit("  call mcount@PLT\n");
+    emit(".L.tail.%s:\n", funcname);
+    emit("  sub rsp, %d\n", fn->stack_size);
+  }
+
+  // Emit code
+  gen_body(fn);
+
+  // Epilogue
+  emit(".L.return.%s:\n", funcname);
+  if (instrument) {
+    prof_leave(fn);
+    prof_fns = realloc(prof_fns, sizeof(char *) * (nprof_fns + 1));
+    prof_fns[nprof_fns++] = strndup(fn->name, strlen(fn->name));
+  }
+  if (profile_generate) {
+    pgo_fns = realloc(pgo_fns, sizeof(PgoFunc) * (npgo_fns + 1));
+    pgo_fns[npgo_fns++] =
+      (PgoFunc){strndup(fn->name, strlen(fn->name)), fn->nprof};
+  }
+  restore_regs(fn);
+  if (omit_frame_pointer) {
+    if (frame_size) {
+      emit("  add rsp, %d\n", frame_size);
+      cfi_adjust(-frame_size);
+    }
+  } else {
+    emit("  mov rsp, rbp\n");
+    emit("  pop rbp\n");
+    emit("  .cfi_def_cfa rsp, 8\n");
+  }
+  emit("  ret\n");
+  emit("  .cfi_endproc\n");
+
+  if (codegen_stats)
+    stats_end_function(omit_frame_pointer ? frame_size : fn->stack_size + 8,
+                       max_depth * 8);
+}
+
+static int cmp_hotness(const void *x, const void *y) {
+  Function *a = *(Function **)x;
+  Function *b = *(Function **)y;
+  long ca = entry_count(a);
+  long cb = entry_count(b);
+  if (ca != cb)
+    return (ca < cb) ? 1 : -1;
+  return (a->seq < b->seq) ? -1 : 1;
+}
+
+void emit_text(Program *prog) {
+  emit(".text\n");
+
+  // With a profile, functions are laid out hottest first so that the
+  // code that runs most shares pages and cache lines.
+  if (profile_use) {
+    int n = 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next)
+      fn->seq = n++;
+
+    Function **fns = calloc(n, sizeof(Function *));
+    int i = 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next)
+      fns[i++] = fn;
+    qsort(fns, n, sizeof(Function *), cmp_hotness);
+    for (int i = 0; i < n; i++)
+      emit_function(fns[i]);
+    free(fns);
+    return;
+  }
+
+  for (Function *fn = prog->fns; fn; fn = fn->next)
+    emit_function(fn);
+}
+
+static void emit_header(void) {
+  emit(".intel_syntax noprefix\n");
+  if (debug_info)
+    emit(".file 1 \"%s\"\n", filename);
 }
 
 void codegen(Program *prog) {
-  printf(".intel_syntax noprefix\n");
-  emit_data(prog);
+  emit_header();
+  emit_data(prog->globals);
   emit_text(prog);
+  emit_prof_table();
+  emit_pgo_table();
+}
+
+// --stream emits each function as soon as it has been parsed, and the
+// data once the whole input has been read.
+void codegen_begin(void) {
+  emit_header();
+  emit(".text\n");
+}
+
+void codegen_function(Function *fn) {
+  emit_function(fn);
+}
+
+void codegen_end(Var *globals) {
+  emit_data(globals);
+  emit_prof_table();
+  emit_pgo_table();
 }
@@ -0,0 +1,409 @@
+#include "9cc.h"
+
+// Common subexpression elimination by value numbering.
+//
+// Expressions are numbered in the order the code generator evaluates
+// them. Two pure expressions get the same number when they apply the
+// same operator to operands with the same numbers. A local's value
+// number changes whenever it is stored to, and all loads from memory
+// (dereferences, globals and locals whose address is taken) change
+// whenever memory may be written: a store through a pointer or to such
+// a variable, or a call.
+//
+// When an expression is seen again, its first occurrence is rewritten
+// to also store the value in a temporary, `(t = e)`, and the repeated
+// one becomes a read of t.
+//
+// Numbers are scoped by the structured control flow. An if's branches
+// and a loop's body see the numbers from before them, but the numbers
+// they create are forgotten when they end. Stores in a loop change
+// numbers before the loop is entered, so only values that stay the same
+// throughout the loop are reused in it.
+
+typedef struct {
+  NodeKind kind;
+  Type *ty;
+  long val;
+  Var *var;
+  int ver;
+  int lhs;
+  int rhs;
+} Key;
+
+// The table is keyed by a Key's fields laid out one after another, so
+// that the padding in Key never takes part in a lookup.
+#define KEY_LEN \
+  (sizeof(NodeKind) + sizeof(Type *) + sizeof(long) + sizeof(Var *) + \
+   3 * sizeof(int))
+
+typedef struct {
+  char key[KEY_LEN];
+  int vn;
+  int size;
+  Node *first;
+  Var *temp;
+  bool valid;
+} Entry;
+
+static Function *fn;
+static HashMap table;
+static int next_vn;
+
+// Entries created in the current scopes
+static Entry **added;
+static int nadded;
+
+// Value versions of locals, indexed by var->offset, and of memory
+static int *versions;
+static int nversions;
+static int mem_version;
+
+// Temporaries created by this pass
+static Entry **temps;
+static int ntemps;
+
+static bool tracked(Var *var) {
+  return var->is_local && !var->addr_taken;
+}
+
+static void write_var(Var *var) {
+  if (tracked(var))
+    versions[var->offset]++;
+  else
+    mem_version++;
+}
+
+// Accounts for every store and call a loop may make, before the loop is
+// entered.
+static void bump_writes(Node *node) {
+  for (; node; node = node->next) {
+    if (node->kind == ND_ASSIGN) {
+      if (node->lhs->kind == ND_VAR)
+        write_var(node->lhs->var);
+      else
+        mem_version++;
+    }
+    if (node->kind == ND_FUNCCALL)
+      mem_version++;
+
+    bump_writes(node->lhs);
+    bump_writes(node->rhs);
+    bump_writes(node->init);
+    bump_writes(node->cond);
+    bump_writes(node->inc);
+    bump_writes(node->then);
+    bump_writes(node->els);
+    bump_writes(node->body);
+    bump_writes(node->args);
+  }
+}
+
+// Worth keeping in a temporary: an expression of at least three nodes,
+// such as a[i] or x*y. Reading a temporary costs as much as `*p` or `&x`.
+static bool is_candidate(Entry *e) {
+  return e->size >= 3;
+}
+
+// A temporary holds the 64-bit value the expression leaves on the stack.
+// An array-typed expression is an address.
+Type *temp_type(Type *ty) {
+  if (ty->kind == TY_PTR)
+    return ty;
+  if (ty->kind == TY_ARRAY)
+    return pointer_to(ty->base);
+  return pointer_to(ty);
+}
+
+static Node *new_var_ref(Var *var, Node *pos) {
+  Node *node = calloc(1, sizeof(Node));
+  node->kind = ND_VAR;
+  node->var = var;
+  node->ty = var->ty;
+  node->line = pos->line;
+  node->col = pos->col;
+  return node;
+}
+
+// Rewrites the first occurrence e of an entry to (t = e).
+static Var *make_temp(Entry *e) {
+  Var *var = calloc(1, sizeof(Var));
+  var->name = strndup(".cse", 4);
+  var->ty = temp_type(e->first->ty);
+  var->is_local = true;
+  var->next = fn->locals;
+  fn->locals = var;
+
+  versions = realloc(versions, sizeof(int) * (nversions + 1));
+  versions[nversions] = 0;
+  var->offset = nversions++;
+
+  Node *first = e->first;
+  Node *expr = calloc(1, sizeof(Node));
+  *expr = *first;
+  expr->next = NULL;
+
+  Node *next = first->next;
+  *first = (Node){.kind = ND_ASSIGN, .ty = var->ty, .next = next,
+                  .line = first->line, .col = first->col};
+  first->lhs = new_var_ref(var, first);
+  first->rhs = expr;
+  e->first = first;
+
+  temps = realloc(temps, sizeof(Entry *) * (ntemps + 1));
+  temps[ntemps++] = e;
+  return var;
+}
+
+// Replaces a repeated expression with a read of the temporary.
+static void reuse(Node *node, Entry *e) {
+  if (!e->temp)
+    e->temp = make_temp(e);
+
+  Node *next = node->next;
+  int line = node->line;
+  int col = node->col;
+  free_node(node->lhs);
+  free_node(node->rhs);
+  *node = (Node){.kind = ND_VAR, .var = e->temp, .ty = e->temp->ty,
+                 .next = next, .line = line, .col = col};
+}
+
+static char *put(char *p, void *field, int size) {
+  memcpy(p, field, size);
+  return p + size;
+}
+
+static void encode_key(Key *key, char *buf) {
+  char *p = buf;
+  p = put(p, &key->kind, sizeof(key->kind));
+  p = put(p, &key->ty, sizeof(key->ty));
+  p = put(p, &key->val, sizeof(key->val));
+  p = put(p, &key->var, sizeof(key->var));
+  p = put(p, &key->ver, sizeof(key->ver));
+  p = put(p, &key->lhs, sizeof(key->lhs));
+  p = put(p, &key->rhs, sizeof(key->rhs));
+  assert(p == buf + KEY_LEN);
+}
+
+static int number(Node *node, Key *key, int size) {
+  char buf[KEY_LEN];
+  encode_key(key, buf);
+
+  Entry *e = hashmap_get(&table, buf, KEY_LEN);
+  if (e && e->valid) {
+    if (is_candidate(e))
+      reuse(node, e);
+    return e->vn;
+  }
+
+  e = calloc(1, sizeof(Entry));
+  memcpy(e->key, buf, KEY_LEN);
+  e->vn = next_vn++;
+  e->size = size;
+  e->first = node;
+  e->valid = true;
+  hashmap_put(&table, e->key, KEY_LEN, e);
+
+  added = realloc(added, sizeof(Entry *) * (nadded + 1));
+  added[nadded++] = e;
+  return e->vn;
+}
+
+// Returns the value number of an expression. *size is set to the number
+// of nodes in it.
+static int value(Node *node, int *size) {
+  Key key = {};
+  key.kind = node->kind;
+  key.ty = node->ty;
+  int lsize = 0;
+  int rsize = 0;
+
+  switch (node->kind) {
+  case ND_NUM:
+    key.val = node->val;
+    *size = 1;
+    return number(node, &key, 1);
+  case ND_VAR:
+    key.var = node->var;
+    if (node->ty->kind == TY_ARRAY)
+      key.ver = 0;
+    else if (tracked(node->var))
+      key.ver = versions[node->var->offset];
+    else
+      key.ver = mem_version;
+    *size = 1;
+    return number(node, &key, 1);
+  case ND_ADDR:
+    if (node->lhs->kind == ND_VAR) {
+      key.var = node->lhs->var;
+      *size = 2;
+    } else {
+      key.lhs = value(node->lhs->lhs, &lsize);
+      *size = lsize + 2;
+    }
+    return number(node, &key, *size);
+  case ND_DEREF:
+    key.lhs = value(node->lhs, &lsize);
+    key.ver = mem_version;
+    *size = lsize + 1;
+    return number(node, &key, *size);
+  case ND_ADD:
+  case ND_PTR_ADD:
+  case ND_SUB:
+  case ND_PTR_SUB:
+  case ND_PTR_DIFF:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    key.lhs = value(node->lhs, &lsize);
+    key.rhs = value(node->rhs, &rsize);
+    *size = lsize + rsize + 1;
+    return number(node, &key, *size);
+  case ND_ASSIGN:
+    if (node->lhs->kind != ND_VAR)
+      value(node->lhs->lhs, &lsize);
+    value(node->rhs, &rsize);
+    if (node->lhs->kind == ND_VAR)
+      write_var(node->lhs->var);
+    else
+      mem_version++;
+    break;
+  case ND_FUNCCALL:
+    for (Node *arg = node->args; arg; arg = arg->next)
+      value(arg, &lsize);
+    mem_version++;
+    break;
+  case ND_SELECT:
+    value(node->cond, &lsize);
+    value(node->then, &lsize);
+    value(node->els, &lsize);
+    break;
+  }
+
+  *size = 1;
+  return next_vn++;
+}
+
+static void visit(Node *node) {
+  int size;
+  if (node)
+    value(node, &size);
+}
+
+static void end_scope(int mark) {
+  for (int i = mark; i < nadded; i++)
+    added[i]->valid = false;
+  nadded = mark;
+}
+
+static void stmt(Node *node) {
+  if (!node)
+    return;
+
+  int mark = nadded;
+
+  switch (node->kind) {
+  case ND_EXPR_STMT:
+    visit(node->lhs);
+    return;
+  case ND_RETURN:
+    visit(node->rhs);
+    return;
+  case ND_IF:
+    visit(node->cond);
+    mark = nadded;
+    stmt(node->then);
+    end_scope(mark);
+    stmt(node->els);
+    end_scope(mark);
+    return;
+  case ND_WHILE:
+  case ND_FOR:
+    stmt(node->init);
+    bump_writes(node->cond);
+    bump_writes(node->inc);
+    bump_writes(node->then);
+    mark = nadded;
+    visit(node->cond);
+    stmt(node->inc);
+    stmt(node->then);
+    end_scope(mark);
+    return;
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      stmt(n);
+    return;
+  case ND_VLOOP:
+    // Nothing in it is reused. It stores to i, the arrays and the sum.
+    bump_writes(node->inc);
+    bump_writes(node->init);
+    if (node->var)
+      write_var(node->var);
+    mem_version++;
+    return;
+  }
+}
+
+static void count_reads(Node *node, int *reads) {
+  for (; node; node = node->next) {
+    if (node->kind == ND_VAR && node->var->is_local)
+      reads[node->var->offset]++;
+    count_reads(node->lhs, reads);
+    count_reads(node->rhs, reads);
+    count_reads(node->init, reads);
+    count_reads(node->cond, reads);
+    count_reads(node->inc, reads);
+    count_reads(node->then, reads);
+    count_reads(node->els, reads);
+    count_reads(node->body, reads);
+    count_reads(node->args, reads);
+  }
+}
+
+void eliminate_common_subexprs(Function *f) {
+  fn = f;
+  table = (HashMap){};
+  next_vn = 0;
+  nadded = 0;
+  ntemps = 0;
+  mem_version = 0;
+
+  nversions = 0;
+  for (Var *var = fn->locals; var; var = var->next)
+    var->offset = nversions++;
+  versions = calloc(nversions, sizeof(int));
+
+  for (Node *node = fn->node; node; node = node->next)
+    stmt(node);
+
+  // A temporary whose later uses were themselves inside a repeated
+  // expression is never read. Its store is taken out again.
+  int *reads = calloc(nversions, sizeof(int));
+  count_reads(fn->node, reads);
+  for (int i = 0; i < ntemps; i++) {
+    Entry *e = temps[i];
+    if (reads[e->temp->offset] > 1)
+      continue;
+
+    Node *def = e->first;
+    Node *expr = def->rhs;
+    Node *next = def->next;
+    free_node(def->lhs);
+    *def = *expr;
+    def->next = next;
+    free(expr);
+  }
+  free(reads);
+
+  for (int i = 0; i < table.capacity; i++)
+    free(table.buckets[i].val);
+  free(table.buckets);
+  free(versions);
+  free(added);
+  added = NULL;
+  free(temps);
+  temps = NULL;
+}
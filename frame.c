@@ -0,0 +1,314 @@
+#include "9cc.h"
+
+// Stack frame layout and register allocation.
+//
+// Every expression position in a function body is numbered in the order
+// the code generator evaluates it, and each local gets the live range
+// between its first and last reference. Locals whose address never
+// escapes are put in registers, the most used ones first, and locals
+// whose ranges do not overlap share a register. The rest share stack
+// slots the same way. Slots are laid out by decreasing alignment so that
+// no padding is needed between them.
+
+typedef struct {
+  Var *var;
+  int first;
+  int last;
+  int weight; // References, weighted by loop nesting
+} Range;
+
+typedef struct Slot Slot;
+struct Slot {
+  int size;
+  int align;
+  Range **vars;
+  int nvars;
+};
+
+static Range *ranges;
+static Range *loops;
+static int nloops;
+static int pos;
+static int loop_depth;
+static bool has_call;
+
+static void walk(Node *node);
+
+static void walk_list(Node *node) {
+  for (; node; node = node->next)
+    walk(node);
+}
+
+// While a pass runs, var->offset holds the index of the var's Range.
+static void walk(Node *node) {
+  if (!node)
+    return;
+
+  int start = pos++;
+
+  if (node->kind == ND_VAR && node->var->is_local) {
+    Range *r = &ranges[node->var->offset];
+    if (r->first > start)
+      r->first = start;
+    if (r->last < start)
+      r->last = start;
+    r->weight += 1 << (loop_depth < 6 ? loop_depth * 3 : 18);
+    return;
+  }
+  if (node->kind == ND_FUNCCALL)
+    has_call = true;
+
+  bool is_loop = node->kind == ND_WHILE || node->kind == ND_FOR ||
+                 node->kind == ND_VLOOP;
+  walk(node->lhs);
+  walk(node->rhs);
+  walk(node->init);
+  loop_depth += is_loop;
+  walk(node->cond);
+  walk(node->inc);
+  walk(node->then);
+  loop_depth -= is_loop;
+  walk(node->els);
+  walk_list(node->body);
+  walk_list(node->args);
+
+  // A value may flow around the back edge of a loop, so anything
+  // referenced in a loop is live throughout it.
+  if (is_loop) {
+    loops = realloc(loops, sizeof(Range) * (nloops + 1));
+    loops[nloops++] = (Range){NULL, start, pos++};
+  }
+}
+
+static bool overlaps(Range *a, Range *b) {
+  return a->first <= b->last && b->first <= a->last;
+}
+
+static int cmp_range(const void *x, const void *y) {
+  Range *r1 = *(Range **)x;
+  Range *r2 = *(Range **)y;
+  Type *a = r1->var->ty;
+  Type *b = r2->var->ty;
+  if (a->align != b->align)
+    return b->align - a->align;
+  if (a->size != b->size)
+    return b->size - a->size;
+  return r1 - r2;
+}
+
+static Var *add_hidden_var(Function *fn, char *name) {
+  Var *var = calloc(1, sizeof(Var));
+  var->name = strndup(name, strlen(name));
+  var->ty = pointer_to(int_type);
+  var->is_local = true;
+  var->whole_function = true;
+  var->next = fn->locals;
+  fn->locals = var;
+  return var;
+}
+
+static int cmp_weight(const void *x, const void *y) {
+  Range *r1 = *(Range **)x;
+  Range *r2 = *(Range **)y;
+  if (r1->weight != r2->weight)
+    return r2->weight - r1->weight;
+  return r1 - r2;
+}
+
+static char *callee_saved[] = {"rbx", "r12", "r13", "r14", "r15"};
+
+// A function that calls nothing may also use caller-saved registers that
+// the generated code leaves alone. rdi, rdx and r11 are scratch, and
+// argument registers still holding parameters are left out.
+static char *caller_saved[] = {"r10", "rsi", "rcx", "r8", "r9"};
+static int caller_saved_arg[] = {6, 1, 3, 4, 5};
+
+static int count_params(Function *fn) {
+  int n = 0;
+  for (Var *var = fn->params; var; var = var->next)
+    n++;
+  return n;
+}
+
+// Puts the most used locals whose address is never taken in registers.
+static void assign_registers(Function *fn, int nvars) {
+  // Caller-saved registers come first since they need not be preserved.
+  char *regs[10];
+  int nregs = 0;
+  if (!has_call) {
+    int nparams = count_params(fn);
+    for (int i = 0; i < 5; i++)
+      if (nparams <= caller_saved_arg[i])
+        regs[nregs++] = caller_saved[i];
+  }
+  int ncaller = nregs;
+  for (int i = 0; i < 5; i++)
+    regs[nregs++] = callee_saved[i];
+
+  Range **cands = calloc(nvars, sizeof(Range *));
+  int ncands = 0;
+  for (int i = 0; i < nvars; i++) {
+    Var *var = ranges[i].var;
+    if (!var->addr_taken && !var->whole_function && ranges[i].weight &&
+        var->ty->kind != TY_ARRAY)
+      cands[ncands++] = &ranges[i];
+  }
+  qsort(cands, ncands, sizeof(Range *), cmp_weight);
+
+  Range ***assigned = calloc(nregs, sizeof(Range **));
+  int *nassigned = calloc(nregs, sizeof(int));
+
+  for (int i = 0; i < ncands; i++) {
+    Range *r = cands[i];
+    for (int j = 0; j < nregs; j++) {
+      bool ok = true;
+      for (int k = 0; k < nassigned[j] && ok; k++)
+        ok = !overlaps(assigned[j][k], r);
+      if (!ok)
+        continue;
+
+      assigned[j] = realloc(assigned[j], sizeof(Range *) * (nassigned[j] + 1));
+      assigned[j][nassigned[j]++] = r;
+      r->var->reg = regs[j];
+      break;
+    }
+  }
+
+  // Callee-saved registers are preserved in slots of their own.
+  for (int j = ncaller; j < nregs; j++)
+    if (nassigned[j])
+      add_hidden_var(fn, ".save")->saved_reg = regs[j];
+
+  for (int j = 0; j < nregs; j++)
+    free(assigned[j]);
+  free(assigned);
+  free(nassigned);
+  free(cands);
+}
+
+void assign_lvar_offsets(Function *fn) {
+  // -finstrument keeps the TSC read at function entry in a hidden local.
+  if (instrument)
+    fn->prof_start = add_hidden_var(fn, ".prof.start");
+
+  int nvars = 0;
+  for (Var *var = fn->locals; var; var = var->next)
+    nvars++;
+
+  ranges = calloc(nvars, sizeof(Range));
+  int i = 0;
+  for (Var *var = fn->locals; var; var = var->next) {
+    ranges[i] = (Range){var, INT_MAX, -1};
+    var->offset = i++;
+  }
+
+  // Parameters are stored by the prologue.
+  for (Var *var = fn->params; var; var = var->next)
+    ranges[var->offset].first = -1;
+
+  pos = 0;
+  nloops = 0;
+  loop_depth = 0;
+  has_call = false;
+  walk_list(fn->node);
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int i = 0; i < nvars; i++) {
+      Range *r = &ranges[i];
+      for (int j = 0; j < nloops; j++) {
+        Range *loop = &loops[j];
+        if (!overlaps(r, loop))
+          continue;
+        if (r->first > loop->first) {
+          r->first = loop->first;
+          changed = true;
+        }
+        if (r->last < loop->last) {
+          r->last = loop->last;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  // Once its address is taken, a var may be accessed anywhere.
+  for (int i = 0; i < nvars; i++) {
+    if (ranges[i].var->addr_taken) {
+      ranges[i].first = -1;
+      ranges[i].last = INT_MAX;
+    }
+  }
+
+  if (opt_level) {
+    assign_registers(fn, nvars);
+
+    // The save slots were added to the front of fn->locals.
+    ranges = realloc(ranges, sizeof(Range) * (nvars + 5));
+    for (Var *var = fn->locals; var && var->saved_reg; var = var->next)
+      ranges[nvars++] = (Range){var};
+  }
+
+  // Hidden slots are used by the prologue and epilogue.
+  for (int i = 0; i < nvars; i++) {
+    if (ranges[i].var->whole_function) {
+      ranges[i].first = -1;
+      ranges[i].last = INT_MAX;
+    }
+  }
+
+  Range **sorted = calloc(nvars, sizeof(Range *));
+  int nsorted = 0;
+  for (int i = 0; i < nvars; i++)
+    if (!ranges[i].var->reg)
+      sorted[nsorted++] = &ranges[i];
+  qsort(sorted, nsorted, sizeof(Range *), cmp_range);
+
+  // Greedily put each var in the first slot that is large enough and
+  // whose current occupants are all dead while the var is live.
+  Slot *slots = calloc(nvars, sizeof(Slot));
+  int nslots = 0;
+
+  for (int i = 0; i < nsorted; i++) {
+    Range *r = sorted[i];
+    Type *ty = r->var->ty;
+    Slot *slot = NULL;
+
+    for (int j = 0; j < nslots && !slot; j++) {
+      Slot *s = &slots[j];
+      if (s->size < ty->size || s->align < ty->align)
+        continue;
+
+      bool ok = true;
+      for (int k = 0; k < s->nvars && ok; k++)
+        ok = !overlaps(s->vars[k], r);
+      if (ok)
+        slot = s;
+    }
+
+    if (!slot) {
+      slot = &slots[nslots++];
+      slot->size = ty->size;
+      slot->align = ty->align;
+      slot->vars = calloc(nvars, sizeof(Range *));
+    }
+    slot->vars[slot->nvars++] = r;
+  }
+
+  int offset = 0;
+  for (int i = 0; i < nslots; i++) {
+    Slot *s = &slots[i];
+    offset = align_to(offset, s->align);
+    offset += s->size;
+    for (int j = 0; j < s->nvars; j++)
+      s->vars[j]->var->offset = offset;
+    free(s->vars);
+  }
+  fn->stack_size = align_to(offset, 8);
+
+  free(slots);
+  free(sorted);
+  free(ranges);
+  free(loops);
+  loops = NULL;
+}
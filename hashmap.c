@@ -0,0 +1,82 @@
+#include "9cc.h"
+
+// Open-addressing hash table keyed by byte strings.
+// Keys are not copied, so they must outlive the map.
+
+#define INIT_SIZE 16
+#define HIGH_WATERMARK 70
+
+static uint64_t fnv_hash(char *s, int len) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (int i = 0; i < len; i++) {
+    hash ^= (unsigned char)s[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+static bool match(HashEntry *ent, char *key, int keylen) {
+  return ent->key && ent->keylen == keylen &&
+         memcmp(ent->key, key, keylen) == 0;
+}
+
+static void rehash(HashMap *map) {
+  HashMap map2 = {};
+  map2.capacity = map->capacity * 2;
+  map2.buckets = calloc(map2.capacity, sizeof(HashEntry));
+
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[i];
+    if (ent->key)
+      hashmap_put(&map2, ent->key, ent->keylen, ent->val);
+  }
+
+  free(map->buckets);
+  *map = map2;
+}
+
+static HashEntry *get_entry(HashMap *map, char *key, int keylen) {
+  if (!map->buckets)
+    return NULL;
+
+  uint64_t hash = fnv_hash(key, keylen);
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[(hash + i) % map->capacity];
+    if (match(ent, key, keylen))
+      return ent;
+    if (!ent->key)
+      return NULL;
+  }
+  return NULL;
+}
+
+void *hashmap_get(HashMap *map, char *key, int keylen) {
+  HashEntry *ent = get_entry(map, key, keylen);
+  return ent ? ent->val : NULL;
+}
+
+void hashmap_put(HashMap *map, char *key, int keylen, void *val) {
+  if (!map->buckets) {
+    map->capacity = INIT_SIZE;
+    map->buckets = calloc(map->capacity, sizeof(HashEntry));
+  } else if ((map->used + 1) * 100 / map->capacity >= HIGH_WATERMARK) {
+    rehash(map);
+  }
+
+  uint64_t hash = fnv_hash(key, keylen);
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[(hash + i) % map->capacity];
+    if (match(ent, key, keylen)) {
+      ent->val = val;
+      return;
+    }
+    if (!ent->key) {
+      ent->key = key;
+      ent->keylen = keylen;
+      ent->val = val;
+      map->used++;
+      return;
+    }
+  }
+  assert(false);
+}
@@ -0,0 +1,704 @@
+#include "9cc.h"
+
+// Loop optimizations.
+//
+// Every while and for loop is a natural loop: its body is entered only
+// through the condition. The statements that run right before it make up
+// its preheader. A loop with work to do there is replaced with a block
+// holding the for-init, the preheader and then the loop itself. Inner
+// loops are handled before the loops around them.
+//
+//  - Strength reduction: in a for loop whose variable i is only changed
+//    by its increment, `i = i + c`, an address base + (i + k) with a base
+//    that does not change in the loop becomes a pointer. It is set up in
+//    the preheader and advanced by c elements next to i, so no
+//    multiplication is left in the loop.
+//  - Loop-invariant code motion: an expression in a loop whose operands
+//    are not written in it is computed once, in the preheader, into a
+//    temporary. The loop may not run at all, so only expressions that
+//    cannot trap are moved. Loads and divisions stay where they are.
+//  - Vectorization (-O2): a counted loop with step 1 whose body is
+//    a[i] = b[i] op c[i], a[i] = b[i] or s = s + b[i] over int or char
+//    arrays runs 16 bytes per iteration with SSE2 first (ND_VLOOP). The
+//    arrays must be distinct array variables, or the same element of
+//    one, so no iteration depends on another. The original loop does
+//    what is left.
+//  - Unrolling (--unroll=N): a small counted loop, `i < n` or `i <= n`
+//    with i only changed by `i = i + c` and n invariant, runs N copies of
+//    its body per test of the condition. A remainder loop, the original
+//    one, runs the last few iterations. With a small constant trip count
+//    the loop is replaced by that many copies. With -fprofile-use, a
+//    loop that seldom runs N iterations in a row is left alone, and
+//    with -fprofile-generate nothing is unrolled so that the counters
+//    see every iteration.
+//
+// Note that a for loop runs its increment before the body, so one
+// iteration is `inc; body` after the condition.
+
+static Function *fn;
+
+// Locals stored to in the current loop
+static Var **written;
+static int nwritten;
+
+// The preheader being built
+static Node pre_head;
+static Node *pre_tail;
+
+static void add_written(Var *var) {
+  written = realloc(written, sizeof(Var *) * (nwritten + 1));
+  written[nwritten++] = var;
+}
+
+static void collect_writes(Node *node) {
+  for (; node; node = node->next) {
+    if (node->kind == ND_ASSIGN && node->lhs->kind == ND_VAR)
+      add_written(node->lhs->var);
+
+    collect_writes(node->lhs);
+    collect_writes(node->rhs);
+    collect_writes(node->init);
+    collect_writes(node->cond);
+    collect_writes(node->inc);
+    collect_writes(node->then);
+    collect_writes(node->els);
+    collect_writes(node->body);
+    collect_writes(node->args);
+  }
+}
+
+static int count_writes(Var *var) {
+  int n = 0;
+  for (int i = 0; i < nwritten; i++)
+    if (written[i] == var)
+      n++;
+  return n;
+}
+
+static bool is_stmt(Node *node) {
+  switch (node->kind) {
+  case ND_RETURN:
+  case ND_IF:
+  case ND_WHILE:
+  case ND_FOR:
+  case ND_BLOCK:
+  case ND_EXPR_STMT:
+  case ND_NULL:
+    return true;
+  }
+  return false;
+}
+
+// Whether an expression has the same value throughout the loop and can
+// be computed before it without trapping.
+static bool is_invariant(Node *node) {
+  switch (node->kind) {
+  case ND_NUM:
+    return true;
+  case ND_VAR:
+    // An array is an address.
+    if (node->ty->kind == TY_ARRAY)
+      return true;
+    return node->var->is_local && !node->var->addr_taken &&
+           !count_writes(node->var);
+  case ND_ADD:
+  case ND_PTR_ADD:
+  case ND_SUB:
+  case ND_PTR_SUB:
+  case ND_PTR_DIFF:
+  case ND_MUL:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    return is_invariant(node->lhs) && is_invariant(node->rhs);
+  }
+  return false;
+}
+
+static bool same_expr(Node *a, Node *b) {
+  if (!a || !b)
+    return a == b;
+  return a->kind == b->kind && a->ty == b->ty && a->val == b->val &&
+         a->var == b->var && same_expr(a->lhs, b->lhs) &&
+         same_expr(a->rhs, b->rhs);
+}
+
+static Node *new_node(NodeKind kind, Type *ty, Node *pos) {
+  Node *node = calloc(1, sizeof(Node));
+  node->kind = kind;
+  node->ty = ty;
+  node->line = pos->line;
+  node->col = pos->col;
+  return node;
+}
+
+static Node *new_var_ref(Var *var, Node *pos) {
+  Node *node = new_node(ND_VAR, var->ty, pos);
+  node->var = var;
+  return node;
+}
+
+static Node *new_num(int val, Node *pos) {
+  Node *node = new_node(ND_NUM, int_type, pos);
+  node->val = val;
+  return node;
+}
+
+// Builds the statement `var = rhs;`.
+static Node *new_store(Var *var, Node *rhs) {
+  Node *assign = new_node(ND_ASSIGN, var->ty, rhs);
+  assign->lhs = new_var_ref(var, rhs);
+  assign->rhs = rhs;
+  Node *stmt = new_node(ND_EXPR_STMT, var->ty, rhs);
+  stmt->lhs = assign;
+  return stmt;
+}
+
+static Var *new_temp(char *name, Type *ty) {
+  Var *var = calloc(1, sizeof(Var));
+  var->name = strndup(name, strlen(name));
+  var->ty = temp_type(ty);
+  var->is_local = true;
+  var->next = fn->locals;
+  fn->locals = var;
+  return var;
+}
+
+// Returns the temporary a preheader statement already stores expr in.
+static Var *find_in_preheader(Node *expr) {
+  for (Node *n = pre_head.next; n; n = n->next)
+    if (same_expr(n->lhs->rhs, expr))
+      return n->lhs->lhs->var;
+  return NULL;
+}
+
+// Turns node into a read of var, keeping its place in a list.
+static void replace_with_var(Node *node, Var *var) {
+  Node *ref = new_var_ref(var, node);
+  ref->next = node->next;
+  *node = *ref;
+  free(ref);
+}
+
+//
+// Loop-invariant code motion
+//
+
+static void hoist_expr(Node *node) {
+  if (node->kind != ND_NUM && node->kind != ND_VAR && is_invariant(node)) {
+    Node *expr = calloc(1, sizeof(Node));
+    *expr = *node;
+    expr->next = NULL;
+
+    Var *var = find_in_preheader(expr);
+    if (var) {
+      free_node(expr);
+    } else {
+      var = new_temp(".licm", expr->ty);
+      pre_tail = pre_tail->next = new_store(var, expr);
+    }
+    replace_with_var(node, var);
+    return;
+  }
+
+  if (node->lhs)
+    hoist_expr(node->lhs);
+  if (node->rhs)
+    hoist_expr(node->rhs);
+  for (Node *arg = node->args; arg; arg = arg->next)
+    hoist_expr(arg);
+}
+
+static void hoist(Node *node) {
+  if (!node)
+    return;
+  if (!is_stmt(node)) {
+    hoist_expr(node);
+    return;
+  }
+
+  hoist(node->lhs);
+  hoist(node->rhs);
+  hoist(node->init);
+  hoist(node->cond);
+  hoist(node->inc);
+  hoist(node->then);
+  hoist(node->els);
+  for (Node *n = node->body; n; n = n->next)
+    hoist(n);
+}
+
+//
+// Strength reduction
+//
+
+// Returns the step c of `i = i + c` or `i = i - c`.
+static bool match_step(Node *inc, Var **iv, int *step) {
+  if (inc->kind != ND_EXPR_STMT || inc->lhs->kind != ND_ASSIGN)
+    return false;
+
+  Node *lhs = inc->lhs->lhs;
+  Node *rhs = inc->lhs->rhs;
+  if (lhs->kind != ND_VAR || lhs->ty->kind != TY_INT ||
+      !lhs->var->is_local || lhs->var->addr_taken)
+    return false;
+  if (rhs->kind != ND_ADD && rhs->kind != ND_SUB)
+    return false;
+
+  Node *var = rhs->lhs;
+  Node *num = rhs->rhs;
+  if (rhs->kind == ND_ADD && var->kind == ND_NUM) {
+    var = rhs->rhs;
+    num = rhs->lhs;
+  }
+  if (var->kind != ND_VAR || var->var != lhs->var || num->kind != ND_NUM)
+    return false;
+
+  *iv = lhs->var;
+  *step = (rhs->kind == ND_ADD) ? num->val : -num->val;
+  return true;
+}
+
+// i, i + k, k + i or i - k
+static bool is_affine(Node *node, Var *iv) {
+  if (node->kind == ND_VAR)
+    return node->var == iv;
+  if (node->kind != ND_ADD && node->kind != ND_SUB)
+    return false;
+  if (node->lhs->kind == ND_VAR && node->lhs->var == iv)
+    return node->rhs->kind == ND_NUM;
+  return node->kind == ND_ADD && node->lhs->kind == ND_NUM &&
+         node->rhs->kind == ND_VAR && node->rhs->var == iv;
+}
+
+typedef struct {
+  Node *inc;
+  Var *iv;
+  int step;
+} Induction;
+
+static void reduce(Node *node, Induction *ind) {
+  if (!node)
+    return;
+
+  if (node->kind == ND_PTR_ADD && is_invariant(node->lhs) &&
+      is_affine(node->rhs, ind->iv)) {
+    Var *var = find_in_preheader(node);
+    if (!var) {
+      var = new_temp(".iv", node->ty);
+      pre_tail = pre_tail->next = new_store(var, copy_node(node));
+
+      // The pointer changes every iteration, so nothing using it may be
+      // hoisted.
+      add_written(var);
+
+      // p = p + c*size, next to i = i + c
+      Node *add = new_node(ND_ADD, var->ty, node);
+      add->lhs = new_var_ref(var, node);
+      add->rhs = new_num(ind->step * var->ty->base->size, node);
+      Node *stmt = new_store(var, add);
+      Node *last = ind->inc->body;
+      while (last->next)
+        last = last->next;
+      last->next = stmt;
+    }
+
+    free_node(node->lhs);
+    free_node(node->rhs);
+    replace_with_var(node, var);
+    return;
+  }
+
+  reduce(node->lhs, ind);
+  reduce(node->rhs, ind);
+  reduce(node->init, ind);
+  reduce(node->cond, ind);
+  reduce(node->then, ind);
+  reduce(node->els, ind);
+  for (Node *n = node->body; n; n = n->next)
+    reduce(n, ind);
+  for (Node *n = node->args; n; n = n->next)
+    reduce(n, ind);
+}
+
+static void reduce_strength(Node *node) {
+  Induction ind = {};
+  if (node->kind != ND_FOR || !node->inc ||
+      !match_step(node->inc, &ind.iv, &ind.step) ||
+      count_writes(ind.iv) != 1)
+    return;
+
+  // The pointers are advanced in the increment, right after i.
+  Node *block = new_node(ND_BLOCK, NULL, node->inc);
+  block->body = node->inc;
+  ind.inc = block;
+
+  reduce(node->cond, &ind);
+  reduce(node->then, &ind);
+
+  if (block->body->next)
+    node->inc = block;
+  else
+    free(block);
+}
+
+//
+// Unrolling
+//
+
+// The most nodes an unrolled loop may grow to
+#define UNROLL_LIMIT 256
+
+static int count_nodes(Node *node) {
+  int n = 0;
+  for (; node; node = node->next)
+    n += 1 + count_nodes(node->lhs) + count_nodes(node->rhs) +
+         count_nodes(node->init) + count_nodes(node->cond) +
+         count_nodes(node->inc) + count_nodes(node->then) +
+         count_nodes(node->els) + count_nodes(node->body) +
+         count_nodes(node->args);
+  return n;
+}
+
+static bool has_loop(Node *node) {
+  for (; node; node = node->next)
+    if (node->kind == ND_WHILE || node->kind == ND_FOR ||
+        has_loop(node->then) || has_loop(node->els) || has_loop(node->body))
+      return true;
+  return false;
+}
+
+// Returns how many times a loop with a constant start and bound runs,
+// or -1 if it is not known or is larger than max.
+static int trip_count(Node *init, Node *cond, Var *iv, int step, int max) {
+  if (!init || init->lhs->kind != ND_ASSIGN ||
+      init->lhs->lhs->kind != ND_VAR || init->lhs->lhs->var != iv ||
+      init->lhs->rhs->kind != ND_NUM || cond->rhs->kind != ND_NUM)
+    return -1;
+
+  long i = init->lhs->rhs->val;
+  long end = cond->rhs->val;
+  int n = 0;
+  while ((cond->kind == ND_LT) ? i < end : i <= end) {
+    if (++n > max)
+      return -1;
+    i += step;
+  }
+  return n;
+}
+
+// Appends `inc; body` for each of n iterations to a list.
+static Node *append_iterations(Node *cur, Node *inc, Node *body, int n) {
+  for (int i = 0; i < n; i++) {
+    cur = cur->next = copy_node(inc);
+    cur = cur->next = copy_node(body);
+  }
+  return cur;
+}
+
+// A loop is cold if the profile says its body never ran, or that it
+// ran fewer than `factor` iterations per entry on average, so that an
+// unrolled copy would rarely be used.
+static bool is_cold(Node *node, int factor) {
+  long evals, taken;
+  if (!branch_counts(fn, node, &evals, &taken))
+    return false;
+  return taken < factor * (evals - taken) || taken == 0;
+}
+
+// Returns the statements that replace an unrolled loop, or NULL if the
+// loop is left alone.
+static Node *unroll(Node *node) {
+  if (unroll_factor < 2 || node->kind != ND_FOR || !node->cond ||
+      !node->inc || profile_generate || is_cold(node, unroll_factor))
+    return NULL;
+
+  // Strength reduction may have added pointer updates after i = i + c.
+  Node *inc = node->inc;
+  Node *step_stmt = (inc->kind == ND_BLOCK) ? inc->body : inc;
+  Var *iv;
+  int step;
+  if (!match_step(step_stmt, &iv, &step) || step <= 0 ||
+      count_writes(iv) != 1)
+    return NULL;
+
+  Node *cond = node->cond;
+  if ((cond->kind != ND_LT && cond->kind != ND_LE) ||
+      cond->lhs->kind != ND_VAR || cond->lhs->var != iv ||
+      !is_invariant(cond->rhs) || has_loop(node->then))
+    return NULL;
+
+  int size = count_nodes(inc) + count_nodes(node->then);
+  Node head = {};
+
+  int n = trip_count(node->init, cond, iv, step, UNROLL_LIMIT / size);
+  if (n >= 0) {
+    Node *cur = append_iterations(&head, inc, node->then, n);
+    cur->next = NULL;
+    if (!head.next)
+      head.next = new_node(ND_NULL, NULL, node);
+    free_node(node->cond);
+    free_node(node->inc);
+    free_node(node->then);
+    node->cond = node->inc = node->then = NULL;
+    return head.next;
+  }
+
+  int factor = unroll_factor;
+  if (size * factor > UNROLL_LIMIT)
+    return NULL;
+
+  // for (; i + (N-1)*c < n; inc) { body; inc; body; ... }
+  Node *loop = new_node(ND_FOR, NULL, node);
+  Node *bound = new_node(ND_ADD, int_type, cond);
+  bound->lhs = copy_node(cond->lhs);
+  bound->rhs = new_num((factor - 1) * step, cond);
+  loop->cond = new_node(cond->kind, cond->ty, cond);
+  loop->cond->lhs = bound;
+  loop->cond->rhs = copy_node(cond->rhs);
+  loop->inc = copy_node(inc);
+
+  Node *block = new_node(ND_BLOCK, NULL, node->then);
+  Node *cur = block->body = copy_node(node->then);
+  append_iterations(cur, inc, node->then, factor - 1);
+  loop->then = block;
+
+  // The remaining iterations
+  Node *rest = new_node(ND_FOR, NULL, node);
+  rest->prof_id = node->prof_id;
+  rest->cond = node->cond;
+  rest->inc = node->inc;
+  rest->then = node->then;
+  node->cond = node->inc = node->then = NULL;
+
+  loop->next = rest;
+  return loop;
+}
+
+//
+// Vectorization
+//
+
+// Returns k of an index i + k, k + i or i - k.
+static int index_offset(Node *node) {
+  if (node->kind == ND_VAR)
+    return 0;
+  if (node->kind == ND_SUB)
+    return -node->rhs->val;
+  return (node->lhs->kind == ND_NUM) ? node->lhs->val : node->rhs->val;
+}
+
+// Matches an element a[i + k] of an int or char array variable.
+static bool is_element(Node *node, Var *iv) {
+  if (node->kind != ND_DEREF || node->lhs->kind != ND_PTR_ADD)
+    return false;
+  Node *base = node->lhs->lhs;
+  return base->kind == ND_VAR && base->ty->kind == TY_ARRAY &&
+         (base->ty->base->kind == TY_INT || base->ty->base->kind == TY_CHAR) &&
+         is_affine(node->lhs->rhs, iv);
+}
+
+// The address of an element for the iteration after the one i is at:
+// base + (i + 1 + k).
+static Node *element_addr(Node *elem, Var *iv) {
+  Node *ptr = elem->lhs;
+  Node *idx = new_node(ND_ADD, int_type, ptr);
+  idx->lhs = new_var_ref(iv, ptr);
+  idx->rhs = new_num(1 + index_offset(ptr->rhs), ptr);
+  Node *addr = new_node(ND_PTR_ADD, ptr->ty, ptr);
+  addr->lhs = copy_node(ptr->lhs);
+  addr->rhs = idx;
+  return addr;
+}
+
+// A source may be the destination itself, but no other element of it.
+static bool independent(Node *dst, Node *src) {
+  return dst->lhs->lhs->var != src->lhs->lhs->var ||
+         index_offset(dst->lhs->rhs) == index_offset(src->lhs->rhs);
+}
+
+// Returns a vectorized copy of the loop to run before it, or NULL.
+static Node *vectorize(Node *node) {
+  Var *iv;
+  int step;
+  if (opt_level < 2 || node->kind != ND_FOR || !node->cond || !node->inc ||
+      !match_step(node->inc, &iv, &step) || step != 1 ||
+      count_writes(iv) != 1)
+    return NULL;
+
+  Node *cond = node->cond;
+  if ((cond->kind != ND_LT && cond->kind != ND_LE) ||
+      cond->lhs->kind != ND_VAR || cond->lhs->var != iv ||
+      !is_invariant(cond->rhs))
+    return NULL;
+
+  Node *stmt = node->then;
+  if (stmt->kind == ND_BLOCK && stmt->body && !stmt->body->next)
+    stmt = stmt->body;
+  if (stmt->kind != ND_EXPR_STMT || stmt->lhs->kind != ND_ASSIGN)
+    return NULL;
+
+  Node *lhs = stmt->lhs->lhs;
+  Node *rhs = stmt->lhs->rhs;
+  Node *dst = NULL;
+  Node *src[2] = {};
+  NodeKind op;
+  Var *sum = NULL;
+
+  if (lhs->kind == ND_VAR) {
+    // s = s + b[i]
+    sum = lhs->var;
+    if (sum == iv || !sum->is_local || sum->addr_taken ||
+        sum->ty->kind != TY_INT || rhs->kind != ND_ADD)
+      return NULL;
+    Node *other = rhs->lhs;
+    src[0] = rhs->rhs;
+    if (other->kind != ND_VAR) {
+      other = rhs->rhs;
+      src[0] = rhs->lhs;
+    }
+    if (other->kind != ND_VAR || other->var != sum ||
+        !is_element(src[0], iv) || src[0]->ty->kind != TY_INT)
+      return NULL;
+    op = ND_ADD;
+  } else {
+    dst = lhs;
+    if (!is_element(dst, iv))
+      return NULL;
+    if (is_element(rhs, iv)) {
+      op = ND_ASSIGN;
+      src[0] = rhs;
+    } else if (rhs->kind == ND_ADD || rhs->kind == ND_SUB ||
+               rhs->kind == ND_EQ) {
+      op = rhs->kind;
+      src[0] = rhs->lhs;
+      src[1] = rhs->rhs;
+      if (!is_element(src[0], iv) || !is_element(src[1], iv))
+        return NULL;
+    } else {
+      return NULL;
+    }
+  }
+
+  Type *ty = src[0]->ty;
+  for (int i = 0; i < 2 && src[i]; i++)
+    if (src[i]->ty != ty || (dst && !independent(dst, src[i])))
+      return NULL;
+  if (dst && dst->ty != ty)
+    return NULL;
+
+  // for (; i + (W-1) < n; i = i + W), W elements at a time
+  int width = 16 / ty->size;
+  Node *loop = new_node(ND_VLOOP, ty, node);
+  loop->val = op;
+
+  Node *bound = new_node(ND_ADD, int_type, cond);
+  bound->lhs = new_var_ref(iv, cond);
+  bound->rhs = new_num(width - 1, cond);
+  loop->cond = new_node(cond->kind, cond->ty, cond);
+  loop->cond->lhs = bound;
+  loop->cond->rhs = copy_node(cond->rhs);
+
+  Node *inc = new_node(ND_ADD, int_type, node->inc);
+  inc->lhs = new_var_ref(iv, node->inc);
+  inc->rhs = new_num(width, node->inc);
+  loop->inc = new_store(iv, inc);
+
+  if (dst)
+    loop->lhs = element_addr(dst, iv);
+  loop->args = element_addr(src[0], iv);
+  if (src[1])
+    loop->args->next = element_addr(src[1], iv);
+
+  // s = s + (the sum of the lanes)
+  if (sum) {
+    loop->var = new_temp(".vsum", int_type);
+    Node *add = new_node(ND_ADD, int_type, stmt);
+    add->lhs = new_var_ref(sum, stmt);
+    add->rhs = new_var_ref(loop->var, stmt);
+    loop->init = new_store(sum, add);
+  }
+  return loop;
+}
+
+//
+// Driver
+//
+
+static void optimize_loop(Node *node) {
+  pre_head.next = NULL;
+  pre_tail = &pre_head;
+
+  nwritten = 0;
+  collect_writes(node->cond);
+  collect_writes(node->inc);
+  collect_writes(node->then);
+
+  // After a vectorized loop the scalar one runs only a few iterations,
+  // from where the vector loop left i.
+  Node *vloop = vectorize(node);
+  if (!vloop)
+    reduce_strength(node);
+  hoist(node->cond);
+  hoist(node->then);
+  if (vloop)
+    hoist_expr(vloop->cond);
+
+  Node *loops = vloop ? NULL : unroll(node);
+  if (!loops && !pre_head.next && !vloop)
+    return;
+
+  if (!loops) {
+    loops = calloc(1, sizeof(Node));
+    *loops = *node;
+    loops->next = NULL;
+    loops->init = NULL;
+  }
+  if (vloop) {
+    vloop->next = loops;
+    loops = vloop;
+  }
+
+  Node *init = node->init;
+  Node *next = node->next;
+  *node = (Node){.kind = ND_BLOCK, .next = next, .line = node->line,
+                 .col = node->col};
+
+  Node head = {};
+  Node *cur = &head;
+  if (init)
+    cur = cur->next = init;
+  cur->next = pre_head.next;
+  while (cur->next)
+    cur = cur->next;
+  cur->next = loops;
+  node->body = head.next;
+}
+
+static void visit(Node *node) {
+  for (; node; node = node->next) {
+    switch (node->kind) {
+    case ND_IF:
+      visit(node->then);
+      visit(node->els);
+      break;
+    case ND_WHILE:
+    case ND_FOR:
+      visit(node->then);
+      optimize_loop(node);
+      break;
+    case ND_BLOCK:
+      visit(node->body);
+      break;
+    }
+  }
+}
+
+void optimize_loops(Function *f) {
+  fn = f;
+  visit(fn->node);
+  free(written);
+  written = NULL;
+  nwritten = 0;
+}
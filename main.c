@@ -2,29 +2,242 @@
 
 char *user_input;
 
+// Name of the input for -g
+char *filename;
+
+// -fomit-frame-pointer
+bool omit_frame_pointer;
+
+// -fPIC: reach globals other modules may define through the GOT
+bool pic;
+
+// -j<N>: number of threads used by the frontend
+int jobs = 1;
+
+// --stream: compile one function at a time
+bool stream;
+
+// -finstrument: count calls and cycles of every function
+bool instrument;
+
+// -pg: call mcount on function entry for gprof
+bool profile_mcount;
+
+// -g: emit line numbers
+bool debug_info;
+
+// -O<N>: 0 turns the AST optimizer off
+int opt_level = 1;
+
+// --unroll=N: copies of the body per iteration of a counted loop.
+// 0 lets -O decide.
+int unroll_factor;
+
+// -fprofile-generate and -fprofile-use[=FILE]
+bool profile_generate;
+char *profile_use;
+
+// Reads the whole program from fp.
+static char *read_all(FILE *fp, char *name) {
+  int cap = 4096;
+  int len = 0;
+  char *buf = malloc(cap);
+
+  for (;;) {
+    if (len == cap - 1) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    int n = fread(buf + len, 1, cap - 1 - len, fp);
+    if (n == 0)
+      break;
+    len += n;
+  }
+  if (ferror(fp))
+    error("%sを読み込めません", name);
+
+  buf[len] = '\0';
+  return buf;
+}
+
+static char *read_file(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("%sを開けません", path);
+  char *buf = read_all(fp, path);
+  fclose(fp);
+  return buf;
+}
+
+static bool endswith(char *s, char *suffix) {
+  int n = strlen(s);
+  int m = strlen(suffix);
+  return n >= m && !strcmp(s + n - m, suffix);
+}
+
+// Lexes, parses and emits one top-level declaration at a time, freeing
+// each function's tokens and AST right after its code is emitted. Only
+// globals are kept until the end. Memory use is thus bounded by the
+// largest function rather than the whole input.
+static void compile_stream(void) {
+  codegen_begin();
+
+  for (;;) {
+    Token *tok = tokenize_decl();
+    if (tok->kind == TK_EOF) {
+      free_tokens(tok);
+      break;
+    }
+
+    token = tok;
+    Function *fn = top_level();
+    if (!at_eof())
+      error_at(token->str, "宣言の終わりではありません");
+
+    if (fn) {
+      // Counters are numbered on the tree as written, so that the
+      // optimizer can see the profile.
+      assign_profile_ids(fn);
+      if (opt_level)
+        optimize(fn);
+      assign_lvar_offsets(fn);
+      codegen_function(fn);
+      free_function(fn);
+    }
+    free_tokens(tok);
+  }
+
+  codegen_end(parsed_globals());
+}
+
 int main(int argc, char **argv) {
-  if (argc != 2) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-fomit-frame-pointer")) {
+      omit_frame_pointer = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fPIC")) {
+      pic = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--codegen-stats") ||
+        !strcmp(argv[i], "--codegen-stats=text")) {
+      codegen_stats = STATS_TEXT;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--codegen-stats=json")) {
+      codegen_stats = STATS_JSON;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-finstrument")) {
+      instrument = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fprofile-generate")) {
+      profile_generate = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fprofile-use")) {
+      profile_use = "9cc.pgo";
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fprofile-use=", 14)) {
+      profile_use = argv[i] + 14;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-O", 2)) {
+      opt_level = argv[i][2] ? atoi(argv[i] + 2) : 1;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "--unroll=", 9)) {
+      unroll_factor = atoi(argv[i] + 9);
+      if (unroll_factor < 1)
+        error("--unrollには正の数を指定してください");
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-g")) {
+      debug_info = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-pg")) {
+      profile_mcount = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "--stream")) {
+      stream = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-j", 2)) {
+      jobs = atoi(argv[i] + 2);
+      if (jobs < 1)
+        error("-jには正の数を指定してください");
+      continue;
+    }
+
+    if (user_input)
+      error("引数の個数が正しくありません");
+
+    // "-" reads the program from stdin, and "*.c" from that file.
+    if (!strcmp(argv[i], "-")) {
+      filename = "<stdin>";
+      user_input = read_all(stdin, "標準入力");
+    } else if (endswith(argv[i], ".c")) {
+      filename = argv[i];
+      user_input = read_file(argv[i]);
+    } else {
+      filename = "<command line>";
+      user_input = argv[i];
+    }
+  }
+
+  if (!user_input) {
     error("引数の個数が正しくありません");
     return 1;
   }
 
+  if (!unroll_factor)
+    unroll_factor = (opt_level >= 2) ? 4 : 1;
+
+  if (profile_mcount && omit_frame_pointer)
+    error("-pgと-fomit-frame-pointerは同時に指定できません");
+
+  if (profile_use)
+    load_profile(profile_use);
+
+  if (stream) {
+    if (jobs > 1)
+      error("--streamと-jは同時に指定できません");
+    compile_stream();
+    print_codegen_stats();
+    return 0;
+  }
+
   // トークナイズしてパースする
-  user_input = argv[1];
   tokenize();
   Program *prog = program();
 
   for (Function *fn = prog->fns; fn; fn = fn->next) {
-    int offset = 0;
-    for (Var *lv = fn->locals; lv; lv = lv->next) {
-      offset = align_to(offset, lv->ty->align);
-      offset += lv->ty->size;
-      lv->offset = offset;
-    }
-    fn->stack_size = align_to(offset, 8);
-
+    assign_profile_ids(fn);
+    if (opt_level)
+      optimize(fn);
+    assign_lvar_offsets(fn);
   }
 
   codegen(prog);
+  print_codegen_stats();
 
   return 0;
 }
@@ -0,0 +1,596 @@
+#include "9cc.h"
+
+// AST-level cleanup that runs before code generation.
+//
+//  - Constant operands are folded.
+//  - if/while/for with a constant condition lose the branch that cannot
+//    run, and statements after a return are dropped.
+//  - Expression statements without side effects are dropped.
+//  - An if whose arms only store a cheap expression to the same local is
+//    turned into a store of a select, which becomes a cmov, or a setcc
+//    when the arms are 1 and 0.
+//  - A store to a local that is not read again before being overwritten
+//    or going out of scope is removed. Liveness is computed backwards
+//    over the structured control flow, iterating loops to a fixed point.
+//    Locals whose address is taken may be read through a pointer and are
+//    left alone.
+//  - Loop-invariant expressions are moved out of loops, and array
+//    indexing by a loop variable becomes a pointer increment (loop.c).
+//  - Repeated expressions are computed once (cse.c).
+//  - Locals that are no longer referenced are removed from the frame.
+
+//
+// Constant folding and control flow
+//
+
+static bool has_side_effect(Node *node) {
+  if (!node)
+    return false;
+  if (node->kind == ND_ASSIGN || node->kind == ND_FUNCCALL)
+    return true;
+  return has_side_effect(node->lhs) || has_side_effect(node->rhs) ||
+         has_side_effect(node->cond);
+}
+
+// Turns a statement into an empty one, keeping its place in a list.
+static void make_null(Node *node) {
+  Node *next = node->next;
+  int line = node->line;
+  int col = node->col;
+
+  free_node(node->lhs);
+  free_node(node->rhs);
+  free_node(node->init);
+  free_node(node->cond);
+  free_node(node->inc);
+  free_node(node->then);
+  free_node(node->els);
+  for (Node *n = node->body; n;) {
+    Node *nx = n->next;
+    free_node(n);
+    n = nx;
+  }
+
+  *node = (Node){.kind = ND_NULL, .next = next, .line = line, .col = col};
+}
+
+// Moves `with` into the place of `node`. The shell of `with` is freed.
+static void replace(Node *node, Node *with) {
+  Node *next = node->next;
+  *node = *with;
+  node->next = next;
+  free(with);
+}
+
+static void fold(Node *node) {
+  if (!node)
+    return;
+
+  fold(node->lhs);
+  fold(node->rhs);
+  if (!node->lhs || !node->rhs ||
+      node->lhs->kind != ND_NUM || node->rhs->kind != ND_NUM)
+    return;
+
+  long a = node->lhs->val;
+  long b = node->rhs->val;
+  long val;
+
+  switch (node->kind) {
+  case ND_ADD: val = a + b; break;
+  case ND_SUB: val = a - b; break;
+  case ND_MUL: val = a * b; break;
+  case ND_DIV:
+    if (b == 0)
+      return;
+    val = a / b;
+    break;
+  case ND_EQ: val = a == b; break;
+  case ND_NE: val = a != b; break;
+  case ND_LT: val = a < b; break;
+  case ND_LE: val = a <= b; break;
+  default:
+    return;
+  }
+
+  // Immediates are 32 bits.
+  if (val < INT_MIN || INT_MAX < val)
+    return;
+
+  free_node(node->lhs);
+  free_node(node->rhs);
+  node->lhs = node->rhs = NULL;
+  node->kind = ND_NUM;
+  node->val = val;
+}
+
+// If-conversion. Both arms of a select are evaluated, so they must not
+// have side effects or be able to trap, and must be cheap enough to be
+// worth a mispredicted branch.
+#define SELECT_COST 8
+
+static bool is_safe(Node *node) {
+  switch (node->kind) {
+  case ND_NUM:
+  case ND_VAR:
+    return true;
+  case ND_ADD:
+  case ND_PTR_ADD:
+  case ND_SUB:
+  case ND_PTR_SUB:
+  case ND_PTR_DIFF:
+  case ND_MUL:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    return is_safe(node->lhs) && is_safe(node->rhs);
+  }
+  return false;
+}
+
+static int cost(Node *node) {
+  if (node->kind == ND_NUM || node->kind == ND_VAR)
+    return 1;
+  int c = (node->kind == ND_MUL) ? 3 : 1;
+  return c + cost(node->lhs) + cost(node->rhs);
+}
+
+// Returns the `x = e` of an arm that is just that statement.
+static Node *single_store(Node *node) {
+  if (node->kind == ND_BLOCK && node->body && !node->body->next)
+    node = node->body;
+  if (node->kind != ND_EXPR_STMT || node->lhs->kind != ND_ASSIGN)
+    return NULL;
+  Node *assign = node->lhs;
+  if (assign->lhs->kind != ND_VAR || !assign->lhs->var->is_local ||
+      assign->lhs->var->addr_taken || !is_safe(assign->rhs))
+    return NULL;
+  return assign;
+}
+
+static bool is_compare(Node *node) {
+  return node->kind == ND_EQ || node->kind == ND_NE ||
+         node->kind == ND_LT || node->kind == ND_LE;
+}
+
+static bool is_num(Node *node, int val) {
+  return node->kind == ND_NUM && node->val == val;
+}
+
+// if (c) x = a; else x = b;  =>  x = c ? a : b;
+// if (c) x = a;              =>  x = c ? a : x;
+static void convert_if(Node *node) {
+  Node *then = single_store(node->then);
+  if (!then)
+    return;
+
+  Node *els = NULL;
+  if (node->els) {
+    els = single_store(node->els);
+    if (!els || els->lhs->var != then->lhs->var)
+      return;
+  }
+
+  Var *var = then->lhs->var;
+  Node *a = then->rhs;
+  Node *b = els ? els->rhs : NULL;
+  if (cost(a) + (b ? cost(b) : 1) > SELECT_COST)
+    return;
+
+  then->rhs = NULL;
+  if (els)
+    els->rhs = NULL;
+  if (!b) {
+    b = calloc(1, sizeof(Node));
+    *b = *then->lhs;
+  }
+
+  Node *cond = node->cond;
+  node->cond = NULL;
+  Node *value;
+  if (is_compare(cond) && is_num(a, 1) && is_num(b, 0)) {
+    // setcc
+    value = cond;
+    free_node(a);
+    free_node(b);
+  } else if (is_compare(cond) && is_num(a, 0) && is_num(b, 1)) {
+    value = calloc(1, sizeof(Node));
+    *value = (Node){.kind = ND_EQ, .ty = int_type, .lhs = cond, .rhs = a,
+                    .line = cond->line, .col = cond->col};
+    free_node(b);
+  } else {
+    value = calloc(1, sizeof(Node));
+    *value = (Node){.kind = ND_SELECT, .ty = var->ty, .cond = cond,
+                    .then = a, .els = b, .line = cond->line,
+                    .col = cond->col};
+  }
+
+  // Reuse the then-arm's store for the new statement.
+  Node *assign = then;
+  Node *stmt = calloc(1, sizeof(Node));
+  *stmt = (Node){.kind = ND_EXPR_STMT, .lhs = assign, .line = node->line,
+                 .col = node->col};
+  assign->rhs = value;
+
+  if (node->then->kind == ND_BLOCK)
+    node->then->body->lhs = NULL;
+  else
+    node->then->lhs = NULL;
+  make_null(node);
+  replace(node, stmt);
+}
+
+static bool always_returns(Node *node) {
+  switch (node->kind) {
+  case ND_RETURN:
+    return true;
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      if (always_returns(n))
+        return true;
+    return false;
+  case ND_IF:
+    return node->els && always_returns(node->then) &&
+           always_returns(node->els);
+  }
+  return false;
+}
+
+static void simplify(Node *node);
+
+// Simplifies each statement, drops empty ones and cuts the list after
+// one that always returns.
+static Node *simplify_list(Node *node) {
+  Node head = {};
+  Node *cur = &head;
+
+  while (node) {
+    Node *next = node->next;
+    simplify(node);
+
+    if (node->kind == ND_NULL) {
+      free_node(node);
+      node = next;
+      continue;
+    }
+
+    cur = cur->next = node;
+    if (always_returns(node)) {
+      for (Node *n = next; n;) {
+        Node *nx = n->next;
+        free_node(n);
+        n = nx;
+      }
+      break;
+    }
+    node = next;
+  }
+
+  cur->next = NULL;
+  return head.next;
+}
+
+// for-loop init and inc are optional.
+static Node *simplify_opt(Node *node) {
+  if (!node)
+    return NULL;
+  simplify(node);
+  if (node->kind == ND_NULL) {
+    free_node(node);
+    return NULL;
+  }
+  return node;
+}
+
+static void simplify(Node *node) {
+  switch (node->kind) {
+  case ND_EXPR_STMT:
+    fold(node->lhs);
+    if (!has_side_effect(node->lhs))
+      make_null(node);
+    return;
+  case ND_RETURN:
+    fold(node->rhs);
+    return;
+  case ND_IF:
+    fold(node->cond);
+    simplify(node->then);
+    if (node->els)
+      node->els = simplify_opt(node->els);
+
+    if (node->cond->kind == ND_NUM) {
+      Node *taken = node->cond->val ? node->then : node->els;
+      if (node->cond->val)
+        node->then = NULL;
+      else
+        node->els = NULL;
+
+      make_null(node);
+      if (taken)
+        replace(node, taken);
+      return;
+    }
+
+    if (node->then->kind == ND_NULL && !node->els &&
+        !has_side_effect(node->cond)) {
+      make_null(node);
+      return;
+    }
+    convert_if(node);
+    return;
+  case ND_WHILE:
+    fold(node->cond);
+    if (node->cond->kind == ND_NUM && node->cond->val == 0) {
+      make_null(node);
+      return;
+    }
+    simplify(node->then);
+    return;
+  case ND_FOR:
+    node->init = simplify_opt(node->init);
+    fold(node->cond);
+    if (node->cond && node->cond->kind == ND_NUM && node->cond->val == 0) {
+      Node *init = node->init;
+      node->init = NULL;
+      make_null(node);
+      if (init)
+        replace(node, init);
+      return;
+    }
+    node->inc = simplify_opt(node->inc);
+    simplify(node->then);
+    return;
+  case ND_BLOCK:
+    node->body = simplify_list(node->body);
+    return;
+  }
+}
+
+//
+// Dead store elimination
+//
+
+// Sets of locals, indexed by var->offset while this pass runs.
+typedef uint64_t *Set;
+
+static int nwords;
+
+static Set new_set(void) {
+  return calloc(nwords, sizeof(uint64_t));
+}
+
+static Set copy_set(Set s) {
+  Set t = new_set();
+  memcpy(t, s, nwords * sizeof(uint64_t));
+  return t;
+}
+
+static void set_union(Set s, Set t) {
+  for (int i = 0; i < nwords; i++)
+    s[i] |= t[i];
+}
+
+static bool set_equal(Set s, Set t) {
+  return !memcmp(s, t, nwords * sizeof(uint64_t));
+}
+
+static bool tracked(Var *var) {
+  return var->is_local && !var->addr_taken;
+}
+
+static bool is_live(Set s, Var *var) {
+  return s[var->offset / 64] & (1ULL << (var->offset % 64));
+}
+
+static void add_var(Set s, Var *var) {
+  s[var->offset / 64] |= 1ULL << (var->offset % 64);
+}
+
+static void remove_var(Set s, Var *var) {
+  s[var->offset / 64] &= ~(1ULL << (var->offset % 64));
+}
+
+// Adds the locals read by an expression.
+static void add_uses(Set s, Node *node) {
+  if (!node)
+    return;
+
+  if (node->kind == ND_VAR) {
+    if (tracked(node->var))
+      add_var(s, node->var);
+    return;
+  }
+  if (node->kind == ND_ASSIGN && node->lhs->kind == ND_VAR) {
+    add_uses(s, node->rhs);
+    return;
+  }
+
+  add_uses(s, node->lhs);
+  add_uses(s, node->rhs);
+  add_uses(s, node->cond);
+  add_uses(s, node->then);
+  add_uses(s, node->els);
+  for (Node *arg = node->args; arg; arg = arg->next)
+    add_uses(s, arg);
+}
+
+static Set live(Node *node, Set out, bool transform);
+
+static Set live_list(Node *node, Set out, bool transform) {
+  int n = 0;
+  for (Node *n2 = node; n2; n2 = n2->next)
+    n++;
+
+  Node **stmts = calloc(n, sizeof(Node *));
+  for (int i = 0; i < n; i++, node = node->next)
+    stmts[i] = node;
+
+  Set s = copy_set(out);
+  for (int i = n - 1; i >= 0; i--) {
+    Set in = live(stmts[i], s, transform);
+    free(s);
+    s = in;
+  }
+  free(stmts);
+  return s;
+}
+
+// Returns the locals live before a statement, given those live after it.
+// With transform set, stores that are not read later are removed.
+static Set live(Node *node, Set out, bool transform) {
+  switch (node->kind) {
+  case ND_EXPR_STMT: {
+    Node *expr = node->lhs;
+    while (expr->kind == ND_ASSIGN && expr->lhs->kind == ND_VAR &&
+           tracked(expr->lhs->var) && !is_live(out, expr->lhs->var)) {
+      if (!transform) {
+        expr = expr->rhs;
+        continue;
+      }
+      Node *rhs = expr->rhs;
+      free_node(expr->lhs);
+      free(expr);
+      node->lhs = expr = rhs;
+    }
+
+    if (transform && !has_side_effect(expr)) {
+      make_null(node);
+      return copy_set(out);
+    }
+
+    Set in = copy_set(out);
+    if (expr->kind == ND_ASSIGN && expr->lhs->kind == ND_VAR &&
+        tracked(expr->lhs->var))
+      remove_var(in, expr->lhs->var);
+    add_uses(in, expr);
+    return in;
+  }
+  case ND_RETURN: {
+    Set in = new_set();
+    add_uses(in, node->rhs);
+    return in;
+  }
+  case ND_IF: {
+    Set in = live(node->then, out, transform);
+    if (node->els) {
+      Set e = live(node->els, out, transform);
+      set_union(in, e);
+      free(e);
+    } else {
+      set_union(in, out);
+    }
+    add_uses(in, node->cond);
+    return in;
+  }
+  case ND_WHILE:
+  case ND_FOR: {
+    // head = cond ∪ out ∪ (live before inc and body, looping back to head)
+    Set head = copy_set(out);
+    add_uses(head, node->cond);
+
+    for (;;) {
+      Set body = live(node->then, head, false);
+      Set in = node->inc ? live(node->inc, body, false) : copy_set(body);
+      set_union(in, out);
+      add_uses(in, node->cond);
+      free(body);
+
+      bool done = set_equal(in, head);
+      free(head);
+      head = in;
+      if (done)
+        break;
+    }
+
+    if (transform) {
+      Set body = live(node->then, head, true);
+      if (node->inc) {
+        free(live(node->inc, body, true));
+        if (node->inc->kind == ND_NULL) {
+          free_node(node->inc);
+          node->inc = NULL;
+        }
+      }
+      free(body);
+    }
+
+    if (!node->init)
+      return head;
+    Set in = live(node->init, head, transform);
+    if (node->init->kind == ND_NULL) {
+      free_node(node->init);
+      node->init = NULL;
+    }
+    free(head);
+    return in;
+  }
+  case ND_BLOCK:
+    return live_list(node->body, out, transform);
+  }
+  return copy_set(out);
+}
+
+//
+// Unreferenced locals
+//
+
+static void count_refs(Node *node) {
+  for (; node; node = node->next) {
+    if (node->kind == ND_VAR && node->var->is_local)
+      node->var->offset++;
+    count_refs(node->lhs);
+    count_refs(node->rhs);
+    count_refs(node->init);
+    count_refs(node->cond);
+    count_refs(node->inc);
+    count_refs(node->then);
+    count_refs(node->els);
+    count_refs(node->body);
+    count_refs(node->args);
+  }
+}
+
+// Parameters are stored by the prologue, so only the locals declared in
+// the body, which come before them in the list, can go.
+static void drop_unused_locals(Function *fn) {
+  for (Var *var = fn->locals; var; var = var->next)
+    var->offset = 0;
+  count_refs(fn->node);
+
+  Var head = {};
+  Var *cur = &head;
+  Var *var = fn->locals;
+  while (var && var != fn->params) {
+    Var *next = var->next;
+    if (var->offset) {
+      cur = cur->next = var;
+    } else {
+      free(var->name);
+      free(var);
+    }
+    var = next;
+  }
+  cur->next = var;
+  fn->locals = head.next;
+}
+
+void optimize(Function *fn) {
+  fn->node = simplify_list(fn->node);
+
+  int nvars = 0;
+  for (Var *var = fn->locals; var; var = var->next)
+    var->offset = nvars++;
+  nwords = (nvars + 63) / 64;
+  if (nwords == 0)
+    nwords = 1;
+
+  Set out = new_set();
+  free(live_list(fn->node, out, true));
+  free(out);
+
+  fn->node = simplify_list(fn->node);
+  optimize_loops(fn);
+  eliminate_common_subexprs(fn);
+  drop_unused_locals(fn);
+}
@@ -3,24 +3,33 @@
 Type *char_type = &(Type){ TY_CHAR, 1, 1};
 Type *int_type = &(Type){ TY_INT, 4, 4 };
 
+// Parser state is per thread, so that function bodies can be parsed
+// in parallel (see parse_parallel()).
+
 // All local variable instances created during parsing are
 // accumulated to this list.
-static Var *locals;
+static _Thread_local Var *locals;
 
 // Likewise, global variables are accumulated to this list.
-static Var *globals;
+static _Thread_local Var *globals;
+
+// String literals with the same contents share one global.
+static _Thread_local HashMap strings;
+
+// Set in worker threads. String literals get their labels only after
+// all workers are done, so that numbering does not depend on timing.
+static _Thread_local bool is_worker;
 
 static Type *basetype(void);
 static Type *declarator(Type *ty, char **name);
 static Type *type_suffix(Type*);
-static void global_var(void);
+static Function *function(Type *ty, char *name);
+static void global_var(Type *ty, char *name);
 static Node *declaration(void);
 static bool is_typename(void);
 static Node *stmt(void);
-static Node *stmt2(void);
-static Node *add(void);
+static Node *primary(void);
 static long const_expr(void);
-static Node *postfix(void);
 
 
 Var *find_var(Token *tok) {
@@ -29,7 +38,8 @@ Var *find_var(Token *tok) {
     if(strlen(var->name) == tok->len && !memcmp(tok->str, var->name, tok->len))
       return var;
   for (Var *var = globals; var; var = var->next)
-    if(strlen(var->name) == tok->len && !memcmp(tok->str, var->name, tok->len))
+    if(var->name && strlen(var->name) == tok->len &&
+       !memcmp(tok->str, var->name, tok->len))  // 名前未定の文字列リテラルを除く
       return var;
   return NULL;
 }
@@ -64,11 +74,61 @@ static char *new_label(void) {
   return strndup(buf, 20);
 }
 
-static Type *new_type(TypeKind kind, int size, int align) {
-  Type *ty = calloc(1, sizeof(Type));
+// Derived types are hash-consed: each distinct type exists exactly once,
+// so two types are the same iff they are the same pointer. The key is
+// the fields of the Type laid out one after another, so that padding
+// never takes part in a lookup.
+static HashMap types;
+static mtx_t types_lock;
+static once_flag types_once = ONCE_FLAG_INIT;
+
+static void init_types_lock(void) {
+  mtx_init(&types_lock, mtx_plain);
+}
+
+static void init_type(Type *ty, TypeKind kind, int size, int align) {
+  memset(ty, 0, sizeof(Type));
   ty->kind = kind;
   ty->size = size;
   ty->align = align;
+}
+
+#define TYPE_KEY_LEN \
+  (sizeof(TypeKind) + 3 * sizeof(int) + 2 * sizeof(Type *))
+
+static char *put(char *p, void *field, int size) {
+  memcpy(p, field, size);
+  return p + size;
+}
+
+static void encode_type(Type *ty, char *buf) {
+  char *p = buf;
+  p = put(p, &ty->kind, sizeof(ty->kind));
+  p = put(p, &ty->size, sizeof(ty->size));
+  p = put(p, &ty->align, sizeof(ty->align));
+  p = put(p, &ty->base, sizeof(ty->base));
+  p = put(p, &ty->array_len, sizeof(ty->array_len));
+  p = put(p, &ty->return_ty, sizeof(ty->return_ty));
+  assert(p == buf + TYPE_KEY_LEN);
+}
+
+static Type *intern_type(Type *tmpl) {
+  call_once(&types_once, init_types_lock);
+  mtx_lock(&types_lock);
+
+  char buf[TYPE_KEY_LEN];
+  encode_type(tmpl, buf);
+
+  Type *ty = hashmap_get(&types, buf, TYPE_KEY_LEN);
+  if (!ty) {
+    ty = malloc(sizeof(Type));
+    *ty = *tmpl;
+    char *key = malloc(TYPE_KEY_LEN);
+    memcpy(key, buf, TYPE_KEY_LEN);
+    hashmap_put(&types, key, TYPE_KEY_LEN, ty);
+  }
+
+  mtx_unlock(&types_lock);
   return ty;
 }
 
@@ -82,40 +142,88 @@ int align_to(int n, int align) {
 }
 
 Type *pointer_to(Type *base) {
-  Type *ty = new_type(TY_PTR, 8, 8);
-  ty->base = base;
-  return ty;
+  Type ty;
+  init_type(&ty, TY_PTR, 8, 8);
+  ty.base = base;
+  return intern_type(&ty);
 }
 
 Type *array_of(Type *base, int len){
-  Type *ty = new_type(TY_ARRAY, base->size * len, base->align);
-  ty->base = base;
-  ty->array_len = len;
-  return ty;
+  Type ty;
+  init_type(&ty, TY_ARRAY, base->size * len, base->align);
+  ty.base = base;
+  ty.array_len = len;
+  return intern_type(&ty);
 }
 
 Type *func_type(Type *return_ty) {
-  Type *ty = new_type(TY_FUNC, 1, 1);
-  ty->return_ty = return_ty;
-  return ty;
+  Type ty;
+  init_type(&ty, TY_FUNC, 1, 1);
+  ty.return_ty = return_ty;
+  return intern_type(&ty);
 }
 
 static Node *new_node(NodeKind kind) {
   Node *node = calloc(1, sizeof(Node));
   node->kind = kind;
+  node->line = token->line;
+  node->col = token->col;
     return node;
 }
 
+// A statement is attributed to its first token.
+static Node *new_stmt(NodeKind kind, Token *tok) {
+  Node *node = new_node(kind);
+  node->line = tok->line;
+  node->col = tok->col;
+  return node;
+}
+
+// Types are computed once, when an expression node is built. The parser
+// builds the tree bottom-up, so the operands are already typed.
+static void set_type(Node *node) {
+  switch (node->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+    node->ty = int_type;
+  case ND_ASSIGN:
+  case ND_PTR_ADD:
+  case ND_PTR_SUB:
+  case ND_PTR_DIFF:
+    node->ty = node->lhs->ty;
+    return;
+  case ND_ADDR:
+    if (node->lhs->ty->kind == TY_ARRAY)
+      node->ty = pointer_to(node->lhs->ty->base);
+    else
+      node->ty = pointer_to(node->lhs->ty);
+    return;
+  case ND_DEREF:
+    if (!node->lhs->ty->base)
+      error_at(token->str, "ポインタが不正です。");
+    node->ty = node->lhs->ty->base;
+    return;
+  }
+}
+
 static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs) {
   Node *node = new_node(kind);
   node->lhs = lhs;
   node->rhs = rhs;
+  set_type(node);
   return node;
 }
 
 static Node *new_unary(NodeKind kind, Node *expr) {
   Node *node = new_node(kind);
   node->lhs = expr;
+  set_type(node);
   return node;
 }
 
@@ -126,46 +234,198 @@ static Node *new_num(int val) {
   return node;
 }
 
+// Only locals are marked. Globals are shared by the -j worker threads,
+// which must not write to them, and a global is always in memory anyway.
+static void mark_addr_taken(Var *var) {
+  if (var->is_local)
+    var->addr_taken = true;
+}
+
 static Node *new_var_node(Var *var) {
   Node *node = new_node(ND_VAR);
   node->var = var;
+  node->ty = var->ty;
+  // Arrays decay to their address, so any use may leak it.
+  if (var->ty->kind == TY_ARRAY)
+    mark_addr_taken(var);
   return node;
 }
 
-// Determine whether the next top-level item is a function
-// or a lobal variable by looking ahead input tokens.
-static bool is_function(void) {
+// Functions and global variables share their leading basetype and
+// declarator, which are parsed once before looking at the next token.
+// Returns NULL for a declaration without a declarator.
+static char *top_declarator(Type **ty) {
+  *ty = basetype();
+  if (consume(";"))
+    return NULL;
+
+  char *name = NULL;
   Token *tok = token;
-  bool isfunc = false;
+  *ty = declarator(*ty, &name);
+  if (!name)
+    error_at(tok->str, "識別子ではありません");
+  return name;
+}
 
-  Type *ty = basetype();
+// Parses one top-level declaration. Returns the function if it was a
+// function definition, or NULL otherwise.
+Function *top_level(void) {
+  Type *ty;
+  char *name = top_declarator(&ty);
+  if (!name)
+    return NULL;
 
-  if(!consume(";")) {
-    char *name = NULL;
-    declarator(ty, &name);
-    isfunc = name && consume("(");
+  if (consume("("))
+    return function(ty, name);
+  global_var(ty, name);
+  return NULL;
+}
+
+// A top-level function found by the indexing pass of parse_parallel().
+typedef struct {
+  Type *ty;
+  char *name;
+  Token *params; // First token after "("
+  Var *globals;  // Globals declared before the function
+  Function *fn;
+  Var *literals; // String literals created while parsing the body
+} FuncDecl;
+
+static FuncDecl *decls;
+static int ndecls;
+static atomic_int next_decl;
+
+// Skips a parameter list and a function body without parsing them.
+// Returns false if the function is only a declaration.
+static bool skip_function(void) {
+  while (!consume(")")) {
+    if (at_eof())
+      error_at(token->str, "')'ではありません");
+    token = token->next;
+  }
+
+  if (consume(";"))
+    return false;
+
+  Token *start = token;
+  expect("{");
+  for (int depth = 1; depth > 0; token = token->next) {
+    if (at_eof())
+      error_at(start->str, "'}'ではありません");
+    if (token->kind == TK_RESERVED && token->len == 1) {
+      if (*token->str == '{')
+        depth++;
+      else if (*token->str == '}')
+        depth--;
+    }
   }
+  return true;
+}
+
+static int parse_worker(void *arg) {
+  is_worker = true;
 
-  token = tok;
-  return isfunc;
+  for (;;) {
+    int i = atomic_fetch_add(&next_decl, 1);
+    if (i >= ndecls)
+      return 0;
+
+    FuncDecl *d = &decls[i];
+    token = d->params;
+    globals = d->globals;
+    strings = (HashMap){};
+    d->fn = function(d->ty, d->name);
+    d->literals = globals;
+  }
 }
 
-// program = function*
+// Indexes top-level declarations sequentially, then parses function
+// bodies on `jobs` threads. Global variables only ever get prepended to
+// the list, so the list head at a function's position is a read-only
+// view of exactly the globals visible to it.
+static Function *parse_parallel(void) {
+  while (!at_eof()) {
+    Type *ty;
+    char *name = top_declarator(&ty);
+    if (!name)
+      continue;
+
+    if (consume("(")) {
+      Token *params = token;
+      if (!skip_function())
+        continue;
+
+      decls = realloc(decls, sizeof(FuncDecl) * (ndecls + 1));
+      decls[ndecls++] = (FuncDecl){ty, name, params, globals};
+      continue;
+    }
+    global_var(ty, name);
+  }
+
+  thrd_t *threads = calloc(jobs, sizeof(thrd_t));
+  for (int i = 0; i < jobs; i++)
+    if (thrd_create(&threads[i], parse_worker, NULL) != thrd_success)
+      error("スレッドを作成できません");
+  for (int i = 0; i < jobs; i++)
+    thrd_join(threads[i], NULL);
+  free(threads);
+
+  // Move each function's string literals to the global list and name
+  // them in source order, merging duplicates across functions, so that
+  // the result is the same as from the sequential parser.
+  Function head = {};
+  Function *cur = &head;
+
+  for (int i = 0; i < ndecls; i++) {
+    FuncDecl *d = &decls[i];
+    Var *lits = NULL;
+    for (Var *var = d->literals; var != d->globals;) {
+      Var *next = var->next;
+      var->next = lits;
+      lits = var;
+      var = next;
+    }
+
+    for (Var *var = lits; var;) {
+      Var *next = var->next;
+      int len = var->ty->size - 1;
+      Var *dup = hashmap_get(&strings, var->init_data, len);
+
+      if (dup) {
+        // Already defined by an earlier function; just share its label.
+        var->name = dup->name;
+      } else {
+        var->name = new_label();
+        var->next = globals;
+        globals = var;
+        hashmap_put(&strings, var->init_data, len, var);
+      }
+      var = next;
+    }
+
+    cur = cur->next = d->fn;
+  }
+
+  free(decls);
+  return head.next;
+}
+
+// program = (basetype ";" | basetype declarator (function | global-var))*
 Program *program(void) {
   Function head = {};
   Function *cur = &head;
   globals = NULL;
 
-  while (!at_eof()) {
-    if (is_function()) {
-      Function *fn = function();
+  if (jobs > 1) {
+    head.next = parse_parallel();
+  } else {
+    while (!at_eof()) {
+      Function *fn = top_level();
       if(!fn)
         continue;
       cur->next = fn;
       cur = cur->next;
-      continue;
     }
-    global_var();
   }
 
   Program *prog = calloc(1, sizeof(Program));
@@ -174,56 +434,6 @@ Program *program(void) {
   return prog;
 }
 
-void add_type(Node* node) {
-  if (!node || node->ty)
-    return;
-
-  add_type(node->lhs);
-  add_type(node->rhs);
-  add_type(node->init);
-  add_type(node->cond);
-  add_type(node->inc);
-  add_type(node->then);
-  add_type(node->els);
-
-  for (Node *n = node->body; n; n = n->next)
-    add_type(n);
-  for (Node *n = node->args; n; n = n->next)
-    add_type(n);
-
-  switch (node->kind) {
-  case ND_ADD:
-  case ND_SUB:
-  case ND_MUL:
-  case ND_DIV:
-  case ND_EQ:
-  case ND_NE:
-  case ND_LT:
-  case ND_LE:
-    node->ty = int_type;
-  case ND_ASSIGN:
-  case ND_PTR_ADD:
-  case ND_PTR_SUB:
-  case ND_PTR_DIFF:
-    node->ty = node->lhs->ty;
-    return;
-  case ND_VAR:
-    node->ty = node->var->ty;
-    return;
-  case ND_ADDR:
-    if (node->lhs->ty->kind == TY_ARRAY)
-      node->ty = pointer_to(node->lhs->ty->base);
-    else
-      node->ty = pointer_to(node->lhs->ty);
-    return;
-  case ND_DEREF:
-    if (!node->lhs->ty->base)
-      error_at(token->str, "ポインタが不正です。");
-    node->ty = node->lhs->ty->base;
-    return;
-  }
-}
-
 // basetype = buildin-type
 //
 // builtin-type = "int"
@@ -282,7 +492,6 @@ static Type *type_suffix(Type *ty) {
     expect("]");
   }
 
-  Token *tok = token;
   ty = type_suffix(ty);
 
   ty = array_of(ty, sz);
@@ -306,8 +515,6 @@ void read_func_params(Function *fn) {
   if (consume(")"))
     return;
 
-  Token *tok = token;
-
 //  fn->params = read_func_param();
 //  Var *cur = fn->params;
   Var *cur = read_func_param();
@@ -319,18 +526,14 @@ void read_func_params(Function *fn) {
   fn->params = cur;
 }
 
-// function = basetype declarator "(" params? ")" ("{" stmt* "}" | ";")
-Function *function(void) {
+// function = params? ")" ("{" stmt* "}" | ";")
+static Function *function(Type *ty, char *name) {
   locals = NULL;
 
-  Type *ty = basetype();
-  char *name = NULL;
-  declarator(ty, &name);
-
   // Construct a function object
   Function *fn = calloc(1, sizeof(Function));
   fn->name = name;
-  expect("(");
+  fn->line = token->line;
   read_func_params(fn);
 
   if (consume(";")) {
@@ -351,31 +554,8 @@ Function *function(void) {
   return fn;
 }
 
-static Initializer *new_init_val(Initializer *cur, int sz, int val) {
-  Initializer *init = calloc(1, sizeof(Initializer));
-  init->sz = sz;
-  init->val = val;
-  cur->next = init;
-  return init;
-}
-
-static Initializer *gvar_init_string(char *p, int len) {
-  Initializer head = {};
-  Initializer *cur = &head;
-  for (int i = 0; i < len; i++)
-    cur = new_init_val(cur, 1, p[i]);
-  return head.next;
-}
-
-// global-var = basetype declarator type-suffix ";"
-static void global_var(void) {
-  Type *ty = basetype();
-  if (consume(";"))
-    return;
-
-  char *name = NULL;
-  Token *tok = token;
-  ty = declarator(ty, &name);
+// global-var = type-suffix ";"
+static void global_var(Type *ty, char *name) {
   ty = type_suffix(ty);
 
   new_gvar(name, ty, false);
@@ -394,7 +574,7 @@ static Node *declaration(void) {
   new_lvar(name, ty);
 
   if(consume(";")) {
-    return new_node(ND_NULL);
+    return new_stmt(ND_NULL, tok);
   }
 
   error_at(tok->str, "型定義の方法が不正です。");
@@ -406,13 +586,7 @@ static bool is_typename(void) {
   return peek("int") || peek("char");
 }
 
-static Node *stmt(void) {
-  Node *node = stmt2();
-  add_type(node);
-  return node;
-}
-
-// stmt2 = expr ";"
+// stmt = expr ";"
 //        | "return" expr ";"
 //        | "while" "(" expr ")" stmt
 //        | "for" "(" expr? ";" expr? ";" expr? ")" stmt
@@ -420,31 +594,29 @@ static Node *stmt(void) {
 //        | "{" stmt* "}"
 //        | ";"
 //        | declaration
-Node *stmt2() {
+static Node *stmt(void) {
+  Token *tok = token;
   Node *node;
 
   if (consume("return")) {
-    node = calloc(1, sizeof(Node));
-    node->kind = ND_RETURN;
+    node = new_stmt(ND_RETURN, tok);
     node->rhs = expr();
 
     if (!consume(";"))
       error_at(token->str, "';'ではないトークンです");
     return node;
   } else if (consume("while")) {
-    node = calloc(1, sizeof(Node));
-    node->kind = ND_WHILE;
+    node = new_stmt(ND_WHILE, tok);
     expect("(");
     node->cond = expr();
     expect(")");
     node->then = stmt();
     return node;
   } else if (consume("for")) {
-    node = calloc(1, sizeof(Node));
-    node->kind = ND_FOR;
+    node = new_stmt(ND_FOR, tok);
     expect("(");
     if(!consume(";")) {
-      node->init = expr();
+      node->init = new_unary(ND_EXPR_STMT, expr());
       expect(";");
     }
     if(!consume(";")) {
@@ -452,14 +624,13 @@ Node *stmt2() {
       expect(";");
     }
     if(!consume(";")) {
-      node->inc = expr();
+      node->inc = new_unary(ND_EXPR_STMT, expr());
     }
     expect(")");
     node->then = stmt();
     return node;
   } else if (consume("if")) {
-    node = calloc(1, sizeof(Node));
-    node->kind = ND_IF;
+    node = new_stmt(ND_IF, tok);
     expect("(");
     node->cond = expr();
     expect(")");
@@ -477,14 +648,14 @@ Node *stmt2() {
       cur = cur->next;
     }
 
-    node = calloc(1, sizeof(Node));
-    node->kind = ND_BLOCK;
+    node = new_stmt(ND_BLOCK, tok);
     node->body = head.next;
     return node;
   } else if (is_typename()) {
     return declaration();
   } else {
-    node = expr();
+    node = new_stmt(ND_EXPR_STMT, tok);
+    node->lhs = expr();
 
     if (!consume(";"))
       error_at(token->str, "';'ではないトークンです");
@@ -492,11 +663,6 @@ Node *stmt2() {
   }
 }
 
-// expr = assign
-Node *expr() {
-  return assign();
-}
-
 // 実装が大変なので数値リテラルのみ対応
 static long eval2(Node *node) {
   switch (node->kind) {
@@ -517,50 +683,7 @@ static long const_expr(void) {
   return eval(expr());
 }
 
-// assign = equality ("=" assign)?
-Node *assign() {
-  Node *node = equality();
-  if (consume("="))
-    node = new_binary(ND_ASSIGN, node, assign());
-  return node;
-}
-
-// equality = relational ("==" relational | "!=" relational)*
-Node *equality() {
-  Node *node = relational();
-
-  for(;;) {
-    if (consume("=="))
-      node = new_binary(ND_EQ, node, relational());
-    else if (consume("!="))
-      node = new_binary(ND_NE, node, relational());
-    else
-      return node;
-  }
-}
-
-// add ("<" add | "<=" add | ">" add | ">=" add)*
-Node *relational() {
-  Node *node = add();
-
-  for (;;) {
-    if (consume("<"))
-      node = new_binary(ND_LT, node, add());
-    else if (consume("<="))
-      node = new_binary(ND_LE, node, add());
-    else if (consume(">"))
-      node = new_binary(ND_LT, add(), node);
-    else if (consume(">="))
-      node = new_binary(ND_LE, add(), node);
-    else
-      return node;
-  }
-}
-
 static Node *new_add(Node *lhs, Node *rhs) {
-  add_type(lhs);
-  add_type(rhs);
-
   if (is_integer(lhs->ty) && is_integer(rhs->ty))
     return new_binary(ND_ADD, lhs, rhs);
   if (lhs->ty->base && is_integer(rhs->ty))
@@ -571,9 +694,6 @@ static Node *new_add(Node *lhs, Node *rhs) {
 }
 
 static Node *new_sub(Node *lhs, Node *rhs) {
-  add_type(lhs);
-  add_type(rhs);
-
   if (is_integer(lhs->ty) && is_integer(rhs->ty))
     return new_binary(ND_SUB, lhs, rhs);
   if (lhs->ty->base && is_integer(rhs->ty))
@@ -583,75 +703,215 @@ static Node *new_sub(Node *lhs, Node *rhs) {
   error_at(token->str, "不正なオペランドです。");
 }
 
-// add = mul ("+" mul | "-" mul)*
-static Node *add() {
-  Node *node = mul();
+// Binary operators. A larger prec binds tighter.
+typedef struct {
+  char *op;
+  int prec;
+  NodeKind kind;
+  bool swap; // a > b is parsed as b < a
+} BinOp;
+
+static BinOp binops[] = {
+  {"=",  1, ND_ASSIGN},
+  {"==", 2, ND_EQ},
+  {"!=", 2, ND_NE},
+  {"<",  3, ND_LT},
+  {"<=", 3, ND_LE},
+  {">",  3, ND_LT, true},
+  {">=", 3, ND_LE, true},
+  {"+",  4, ND_ADD},
+  {"-",  4, ND_SUB},
+  {"*",  5, ND_MUL},
+  {"/",  5, ND_DIV},
+};
+
+// Prefix operators bind tighter than any binary operator and looser
+// than "[".
+#define PREC_PREFIX 6
+
+typedef enum {
+  OP_BINARY,
+  OP_PREFIX,
+  OP_PAREN,  // "(" awaiting ")"
+  OP_INDEX,  // "[" awaiting "]"
+} OpKind;
+
+typedef struct {
+  OpKind kind;
+  BinOp *binop;
+  Token *tok;
+} Op;
+
+// Operand and operator stacks. A nested expr() (for function arguments
+// or sizeof) works on top of its caller's entries.
+static _Thread_local Node **nodes;
+static _Thread_local int nnodes;
+static _Thread_local int nodes_cap;
+
+static _Thread_local Op *ops;
+static _Thread_local int nops;
+static _Thread_local int ops_cap;
+
+static void push_node(Node *node) {
+  if (nnodes == nodes_cap) {
+    nodes_cap = nodes_cap ? nodes_cap * 2 : 64;
+    nodes = realloc(nodes, sizeof(Node *) * nodes_cap);
+  }
+  nodes[nnodes++] = node;
+}
 
-  for(;;) {
-    if (consume("+"))
-      node = new_add(node, mul());
-    else if (consume("-"))
-      node = new_sub(node, mul());
-    else
-      return node;
+static void push_op(OpKind kind, BinOp *binop, Token *tok) {
+  if (nops == ops_cap) {
+    ops_cap = ops_cap ? ops_cap * 2 : 64;
+    ops = realloc(ops, sizeof(Op) * ops_cap);
   }
+  ops[nops++] = (Op){kind, binop, tok};
 }
 
-// mul = unary("*" unary | "/" unary)*
-Node *mul() {
-  Node *node = unary();
+static BinOp *find_binop(void) {
+  if (token->kind != TK_RESERVED)
+    return NULL;
+  for (int i = 0; i < sizeof(binops) / sizeof(*binops); i++)
+    if (strlen(binops[i].op) == token->len &&
+        !memcmp(token->str, binops[i].op, token->len))
+      return &binops[i];
+  return NULL;
+}
 
-  for(;;) {
-    if (consume("*"))
-      node = new_binary(ND_MUL, node, unary());
-    else if (consume("/"))
-      node = new_binary(ND_DIV, node, unary());
-    else
-      return node;
+static int op_prec(Op *op) {
+  return op->kind == OP_PREFIX ? PREC_PREFIX : op->binop->prec;
+}
+
+// Pops the topmost operator and applies it to its operands.
+static void reduce(void) {
+  Op *op = &ops[--nops];
+
+  if (op->kind == OP_PREFIX) {
+    Node *node = nodes[--nnodes];
+    switch (*op->tok->str) {
+    case '+':
+      break;
+    case '-':
+      node = new_binary(ND_SUB, new_num(0), node);
+      break;
+    case '*':
+      node = new_unary(ND_DEREF, node);
+      break;
+    case '&':
+      if (node->kind == ND_VAR)
+        mark_addr_taken(node->var);
+      node = new_unary(ND_ADDR, node);
+      break;
+    }
+    push_node(node);
+    return;
   }
+
+  Node *rhs = nodes[--nnodes];
+  Node *lhs = nodes[--nnodes];
+  BinOp *b = op->binop;
+
+  if (b->kind == ND_ADD)
+    push_node(new_add(lhs, rhs));
+  else if (b->kind == ND_SUB)
+    push_node(new_sub(lhs, rhs));
+  else if (b->swap)
+    push_node(new_binary(b->kind, rhs, lhs));
+  else
+    push_node(new_binary(b->kind, lhs, rhs));
+}
+
+// Returns the innermost unclosed "(" or "[" of the current expr(),
+// or NULL.
+static Op *open_bracket(int base) {
+  for (int i = nops - 1; i >= base; i--)
+    if (ops[i].kind == OP_PAREN || ops[i].kind == OP_INDEX)
+      return &ops[i];
+  return NULL;
 }
 
-// unary = "+"? primary
-//       | "-"? primary
-//       | "*" unary
-//       | "&" unary
-//       | postfix
-Node *unary() {
-  if (consume("+"))
-    return primary();
-  if (consume("-"))
-    return new_binary(ND_SUB, new_num(0), primary());
-  if (consume("*"))
-    return new_unary(ND_DEREF, unary());
-  if (consume("&"))
-    return new_unary(ND_ADDR, unary());
-  return postfix();
-}
-
-// postfix = primary ("[" expr "]")*
-static Node *postfix(void) {
-  Node *node = primary();
-  for(;;) {
+// expr       = operand (binop operand)*
+// operand    = ("+" | "-" | "*" | "&")* ("(" expr ")" | primary) ("[" expr "]")*
+//
+// Parsed by precedence climbing with explicit stacks instead of one
+// recursive function per precedence level, so nesting depth of
+// parentheses and brackets is bounded by heap memory only.
+Node *expr(void) {
+  int node_base = nnodes;
+  int op_base = nops;
+  bool want_operand = true;
+
+  for (;;) {
+    Token *tok = token;
+
+    if (want_operand) {
+      if (consume("(")) {
+        push_op(OP_PAREN, NULL, tok);
+        continue;
+      }
+      if (consume("+") || consume("-") || consume("*") || consume("&")) {
+        push_op(OP_PREFIX, NULL, tok);
+        continue;
+      }
+      push_node(primary());
+      want_operand = false;
+      continue;
+    }
+
+    // x[y] is short for *(x+y)
     if (consume("[")) {
-      // x[y] is short for *(x+y)
-      Node  *exp = new_add(node, expr());
-      expect("]");
-      node = new_unary(ND_DEREF, exp);
+      push_op(OP_INDEX, NULL, tok);
+      want_operand = true;
       continue;
     }
-    return node;
+
+    Op *open = open_bracket(op_base);
+    if (open && consume(open->kind == OP_PAREN ? ")" : "]")) {
+      while (&ops[nops - 1] != open)
+        reduce();
+      nops--;
+
+      if (open->kind == OP_INDEX) {
+        Node *idx = nodes[--nnodes];
+        Node *base = nodes[--nnodes];
+        push_node(new_unary(ND_DEREF, new_add(base, idx)));
+      }
+      continue;
+    }
+
+    BinOp *b = find_binop();
+    if (!b)
+      break;
+    token = token->next;
+
+    // "=" is right-associative; everything else is left-associative.
+    while (nops > op_base && ops[nops - 1].kind <= OP_PREFIX &&
+           (op_prec(&ops[nops - 1]) > b->prec ||
+            (op_prec(&ops[nops - 1]) == b->prec && b->kind != ND_ASSIGN)))
+      reduce();
+    push_op(OP_BINARY, b, tok);
+    want_operand = true;
   }
+
+  Op *open = open_bracket(op_base);
+  if (open)
+    error_at(token->str, "'%s'ではありません", open->kind == OP_PAREN ? ")" : "]");
+
+  while (nops > op_base)
+    reduce();
+  assert(nnodes == node_base + 1);
+  return nodes[--nnodes];
 }
 
-// func-args = "(" (assign ("," assign )* )? ")"
+// func-args = "(" (expr ("," expr )* )? ")"
 Node *func_args() {
   if(consume(")"))
     return NULL;
 
-  Node *head = assign();
+  Node *head = expr();
   Node *cur = head;
   while(consume(",")) {
-    cur->next = assign();
+    cur->next = expr();
     cur = cur->next;
   }
   expect(")");
@@ -660,35 +920,22 @@ Node *func_args() {
 
 // primary = num
 //         | ident func-args?
-//         | "(" expr ")"
-//         | "sizeof" "(" type-name ")"
-//         | "sizeof" unary
+//         | "sizeof" "(" (type-name | expr) ")"
 //         | str
 //         | num
-Node *primary() {
-  // 次のトークンが"("なら、"(" expr ")"のはず
-  if (consume("(")) {
-    Node *node = expr();
-    expect(")");
-    return node;
-  }
-
+static Node *primary(void) {
   Token *tok;
 
   if( consume("sizeof") ) {
-    tok = token;
-    if (consume("(")) {
-      if (is_typename()) {
-        Type *ty = basetype();
-        expect(")");
-        return new_num(ty->size);
-      }
-      token = tok->next;
+    expect("(");
+    if (is_typename()) {
+      Type *ty = basetype();
+      expect(")");
+      return new_num(ty->size);
     }
 
-    Node *node = unary();
+    Node *node = expr();
     expect(")");
-    add_type(node);
     return new_num(node->ty->size);
   }
 
@@ -699,8 +946,6 @@ Node *primary() {
       node->funcname = strndup(tok->str, tok->len);
       node->args = func_args();
       node->ty = int_type;  // グローバル変数を導入するまで暫定
-      consume(")");
-      add_type(node);
       return node;
     }
 
@@ -716,12 +961,97 @@ Node *primary() {
   if (token->kind == TK_STR) {
     token = token->next;  // returnする前に次にすすめる
 
-    Type *ty = array_of(char_type, tok->cont_len);
-    Var *var = new_gvar(new_label(), ty, true);
-    var->initializer = gvar_init_string(tok->contents, tok->cont_len);
+    Var *var = hashmap_get(&strings, tok->contents, tok->cont_len);
+    if (!var) {
+      Type *ty = array_of(char_type, tok->cont_len + 1);
+      var = new_gvar(is_worker ? NULL : new_label(), ty, true);
+      var->init_data = tok->contents;
+      hashmap_put(&strings, tok->contents, tok->cont_len, var);
+    }
     return new_var_node(var);
   }
 
   // そうでなければ数値のはず
   return new_num(expect_number());
 }
+
+// Frees a node and everything below it, but not the nodes after it.
+void free_node(Node *node) {
+  if (!node)
+    return;
+
+  free_node(node->lhs);
+  free_node(node->rhs);
+  free_node(node->init);
+  free_node(node->cond);
+  free_node(node->inc);
+  free_node(node->then);
+  free_node(node->els);
+
+  for (Node *n = node->body; n;) {
+    Node *next = n->next;
+    free_node(n);
+    n = next;
+  }
+  for (Node *n = node->args; n;) {
+    Node *next = n->next;
+    free_node(n);
+    n = next;
+  }
+
+  free(node->funcname);
+  free(node);
+}
+
+static Node *copy_list(Node *node) {
+  Node head = {};
+  Node *cur = &head;
+  for (; node; node = node->next)
+    cur = cur->next = copy_node(node);
+  return head.next;
+}
+
+// Copies a node and everything below it, but not the nodes after it.
+Node *copy_node(Node *node) {
+  if (!node)
+    return NULL;
+
+  Node *copy = calloc(1, sizeof(Node));
+  *copy = *node;
+  copy->next = NULL;
+  copy->lhs = copy_node(node->lhs);
+  copy->rhs = copy_node(node->rhs);
+  copy->init = copy_node(node->init);
+  copy->cond = copy_node(node->cond);
+  copy->inc = copy_node(node->inc);
+  copy->then = copy_node(node->then);
+  copy->els = copy_node(node->els);
+  copy->body = copy_list(node->body);
+  copy->args = copy_list(node->args);
+  if (node->funcname)
+    copy->funcname = strndup(node->funcname, strlen(node->funcname));
+  return copy;
+}
+
+// Frees a function once its code has been emitted (--stream).
+// Globals and types are shared and stay alive.
+void free_function(Function *fn) {
+  for (Node *n = fn->node; n;) {
+    Node *next = n->next;
+    free_node(n);
+    n = next;
+  }
+  for (Var *var = fn->locals; var;) {
+    Var *next = var->next;
+    free(var->name);
+    free(var);
+    var = next;
+  }
+  free(fn->name);
+  free(fn);
+}
+
+// Global variables and string literals parsed so far.
+Var *parsed_globals(void) {
+  return globals;
+}
@@ -0,0 +1,122 @@
+#include "9cc.h"
+
+// Profile-guided optimization.
+//
+// -fprofile-generate gives every function a table of counters:
+//
+//   [0]            number of calls of the function
+//   [id], [id+1]   times an if/while/for condition was evaluated, and
+//                  how many of those were true
+//   [id]           times a call site was executed
+//
+// The ids are assigned by walking the AST, so compiling the same source
+// again numbers the counters the same way. At exit the tables are
+// appended to 9cc.pgo as lines of the form "name n c0 c1 ... c(n-1)".
+// -fprofile-use=FILE reads them back, summing the lines of each function
+// over all runs.
+
+typedef struct {
+  int n;
+  long *counts;
+} Profile;
+
+static HashMap profiles;
+
+static void walk(Node *node, int *n);
+
+static void walk_list(Node *node, int *n) {
+  for (; node; node = node->next)
+    walk(node, n);
+}
+
+static void walk(Node *node, int *n) {
+  if (!node)
+    return;
+
+  switch (node->kind) {
+  case ND_IF:
+  case ND_WHILE:
+  case ND_FOR:
+    node->prof_id = *n;
+    *n += 2;
+    break;
+  case ND_FUNCCALL:
+    node->prof_id = *n;
+    *n += 1;
+    break;
+  }
+
+  walk(node->lhs, n);
+  walk(node->rhs, n);
+  walk(node->init, n);
+  walk(node->cond, n);
+  walk(node->inc, n);
+  walk(node->then, n);
+  walk(node->els, n);
+  walk_list(node->body, n);
+  walk_list(node->args, n);
+}
+
+// Numbers the counters of fn and, with -fprofile-use, attaches the
+// counts recorded for it. A function whose shape has changed since the
+// profile was taken gets no counts.
+void assign_profile_ids(Function *fn) {
+  int n = 1;
+  walk_list(fn->node, &n);
+  fn->nprof = n;
+
+  if (!profile_use)
+    return;
+
+  Profile *prof = hashmap_get(&profiles, fn->name, strlen(fn->name));
+  if (prof && prof->n == n)
+    fn->prof = prof->counts;
+}
+
+void load_profile(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "warning: %sを開けません\n", path);
+    return;
+  }
+
+  char name[256];
+  int n;
+  while (fscanf(fp, "%255s %d", name, &n) == 2) {
+    long *counts = calloc(n, sizeof(long));
+    for (int i = 0; i < n; i++)
+      if (fscanf(fp, "%ld", &counts[i]) != 1)
+        error("%sが壊れています", path);
+
+    int len = strlen(name);
+    Profile *prof = hashmap_get(&profiles, name, len);
+    if (!prof) {
+      prof = calloc(1, sizeof(Profile));
+      prof->n = n;
+      prof->counts = counts;
+      hashmap_put(&profiles, strndup(name, len), len, prof);
+      continue;
+    }
+
+    // Another run of the same program
+    if (prof->n == n)
+      for (int i = 0; i < n; i++)
+        prof->counts[i] += counts[i];
+    free(counts);
+  }
+  fclose(fp);
+}
+
+// Returns how often a branch node's condition was evaluated and how
+// often it was true, or false if there is no profile for it.
+bool branch_counts(Function *fn, Node *node, long *evals, long *taken) {
+  if (!fn->prof || !node->prof_id)
+    return false;
+  *evals = fn->prof[node->prof_id];
+  *taken = fn->prof[node->prof_id + 1];
+  return true;
+}
+
+long entry_count(Function *fn) {
+  return fn->prof ? fn->prof[0] : 0;
+}
@@ -0,0 +1,148 @@
+#include "9cc.h"
+
+// --codegen-stats: counts what the code generator emits.
+//
+// Every instruction line is classified by its mnemonic and operands as
+// it is printed. The report goes to stderr so that it does not mix with
+// the assembly.
+
+typedef enum {
+  IC_STACK,  // push, pop
+  IC_LOAD,   // mov from memory
+  IC_STORE,  // mov to memory
+  IC_ARITH,  // add, sub, cmp, setcc, lea, ...
+  IC_BRANCH, // jmp, jcc, ret
+  IC_CALL,   // call
+  IC_IDIV,   // idiv
+  IC_OTHER,  // register moves and the rest
+  IC_END,
+} InsnClass;
+
+static char *class_name[] = {
+  "push_pop", "load", "store", "arith", "branch", "call", "idiv", "other",
+};
+
+typedef struct {
+  char *name;
+  int insns[IC_END];
+  int total;
+  int frame_size;
+  int temp_size;
+} FuncStats;
+
+StatsFormat codegen_stats;
+
+static FuncStats *funcs;
+static int nfuncs;
+static FuncStats *cur;
+static int data_size;
+
+void stats_begin_function(char *name) {
+  funcs = realloc(funcs, sizeof(FuncStats) * (nfuncs + 1));
+  cur = &funcs[nfuncs++];
+  *cur = (FuncStats){.name = strndup(name, strlen(name))};
+}
+
+void stats_end_function(int frame_size, int temp_size) {
+  cur->frame_size = frame_size;
+  cur->temp_size = temp_size;
+  cur = NULL;
+}
+
+void stats_data(int size) {
+  data_size += size;
+}
+
+static InsnClass classify(char *op, char *operands) {
+  if (startswith(op, "push ") || startswith(op, "pop "))
+    return IC_STACK;
+  if (startswith(op, "call "))
+    return IC_CALL;
+  if (startswith(op, "idiv "))
+    return IC_IDIV;
+  if (op[0] == 'j' || startswith(op, "ret"))
+    return IC_BRANCH;
+
+  if (startswith(op, "mov")) {
+    char *comma = strchr(operands, ',');
+    char *mem = strchr(operands, '[');
+    if (!mem)
+      return IC_OTHER;
+    return (comma && mem < comma) ? IC_STORE : IC_LOAD;
+  }
+  return IC_ARITH;
+}
+
+// Called with each line of output. Directives and labels are ignored.
+void stats_line(char *line) {
+  if (!cur || !startswith(line, "  ") || !isalpha(line[2]))
+    return;
+
+  char *op = line + 2;
+  char *operands = op;
+  while (*operands && *operands != ' ' && *operands != '\n')
+    operands++;
+
+  cur->insns[classify(op, operands)]++;
+  cur->total++;
+}
+
+static void print_text(void) {
+  FuncStats total = {.name = "total"};
+
+  fprintf(stderr, "%-16s %7s", "function", "insns");
+  for (int i = 0; i < IC_END; i++)
+    fprintf(stderr, " %8s", class_name[i]);
+  fprintf(stderr, " %6s %6s\n", "frame", "temps");
+
+  for (int i = 0; i <= nfuncs; i++) {
+    FuncStats *fs = (i < nfuncs) ? &funcs[i] : &total;
+    fprintf(stderr, "%-16s %7d", fs->name, fs->total);
+    for (int j = 0; j < IC_END; j++)
+      fprintf(stderr, " %8d", fs->insns[j]);
+    fprintf(stderr, " %6d %6d\n", fs->frame_size, fs->temp_size);
+
+    if (i < nfuncs) {
+      for (int j = 0; j < IC_END; j++)
+        total.insns[j] += fs->insns[j];
+      total.total += fs->total;
+      total.frame_size += fs->frame_size;
+      total.temp_size += fs->temp_size;
+    }
+  }
+
+  fprintf(stderr, "data: %d bytes\n", data_size);
+}
+
+static void print_json_counts(FuncStats *fs) {
+  fprintf(stderr, "\"insns\": %d", fs->total);
+  for (int i = 0; i < IC_END; i++)
+    fprintf(stderr, ", \"%s\": %d", class_name[i], fs->insns[i]);
+}
+
+static void print_json(void) {
+  FuncStats total = {0};
+
+  fprintf(stderr, "{\"functions\": [");
+  for (int i = 0; i < nfuncs; i++) {
+    FuncStats *fs = &funcs[i];
+    fprintf(stderr, "%s\n  {\"name\": \"%s\", ", i ? "," : "", fs->name);
+    print_json_counts(fs);
+    fprintf(stderr, ", \"frame\": %d, \"temps\": %d}", fs->frame_size,
+            fs->temp_size);
+
+    for (int j = 0; j < IC_END; j++)
+      total.insns[j] += fs->insns[j];
+    total.total += fs->total;
+  }
+  fprintf(stderr, "],\n \"total\": {");
+  print_json_counts(&total);
+  fprintf(stderr, "},\n \"data\": %d}\n", data_size);
+}
+
+void print_codegen_stats(void) {
+  if (codegen_stats == STATS_TEXT)
+    print_text();
+  else if (codegen_stats == STATS_JSON)
+    print_json();
+}
@@ -3,8 +3,8 @@ try() {
   expected="$1"
   input="$2"
 
-  ./9cc "$input" > tmp.s
-  gcc -static -o tmp tmp.s
+  ./9cc $OPTS "$input" > tmp.s
+  gcc -o tmp tmp.s
   ./tmp
   actual="$?"
 
@@ -73,5 +73,200 @@ try 3 'int main(){int a[2]; a[0]=1; a[1]=2; int* p; p=a; return *p+*(p+1);}'
 try 1 'int g; int main(){g=1; return g;}'
 try 3 'int main(){char x[3]; x[0] = -1; x[1] = 2; int y; y = 4; return x[0] + y;}'
 try 111 'int main(){char *s; s = "hello"; return *(s+4);}'
+try 3 'int foo(int a){return a;} int main(){int x; x=3; return foo(x);}'
+try 42 'int f(int n){if(n==0) return 42; return f(n-1);} int main(){return f(10000000);}'
+try 55 'int sum(int n, int acc){if(n==0) return acc; return sum(n-1, acc+n);} int main(){return sum(10, 0);}'
+try 1 'int odd(int n){if(n==0) return 0; return even(n-1);} int even(int n){if(n==0) return 1; return odd(n-1);} int main(){return even(10000000);}'
+try 1 'int f(int n, int *p){if(n==0) return *p; return f(n-1, &n);} int main(){int x; x=9; return f(4, &x);}'
+try 10 'int main(){char a; int b; char c; int *d; a=1; b=2; c=3; d=&b; return a+*d+c+sizeof(d)-sizeof(b);}'
+try 40 'int main(){int s; s=0; {int i; for(i=0;i<4;i=i+1) s=s+i;} {int j; for(j=0;j<4;j=j+1) s=s+j*j;} return s;}'
+try 6 'int main(){int x; int y; int z; x=1; y=x+1; z=y+x; x=0; while(x<3) {z=z+x; x=x+1;} return z;}'
+try 1 'int main(){char *a; char *b; a="abc"; b="abc"; return a==b;}'
+try 2 'int main(){char *a; char *b; a="hello"; b="llo"; return b-a;}'
+try 108 'int main(){char *a; a="llo"; a="hello"; return a[3];}'
+try 34 'int main(){return "a\"b\\"[1];}'
+try 120 "int main(){char *s; s=\"$(printf 'x%.0s' $(seq 3000))\"; return s[2999];}"
+try 0 "int main(){char *s; s=\"$(printf 'x%.0s' $(seq 3000))\\n\"; return s[3001];}"
+try 2 'int main(){return sizeof("a\nb")-sizeof("a");}'
+try 3 "int main(){return $(printf '(%.0s' $(seq 30000))3$(printf ')%.0s' $(seq 30000));}"
+try 7 'int f(){return 1;} int main(){if (f()) return (f()+6); return 0;}'
+try 254 'int main(){int a[2]; a[1]=2; return -a[1];}'
+try 4 'int main(){int x; return sizeof(x+1);}'
+try 10 'int main(){int a; int b; a=b=5; return a+b;}'
+try 0 'int main(){return 2*3-4/2 == 4 > 3;}'
+try 5 'int g; int f(int x); int *h; int; int main(){g=2; h=&g; return f(*h);} int f(int x){return x+3;}'
+try 3 'int main(){return 3; return 5;}'
+try 1 'int main(){int x; x=1; if (0) x=2; while (0) x=3; return x;}'
+try 7 'int main(){int x; int y; x=5; y=x*2; x=7; 1+2; return x;}'
+try 16 'int main(){int a; int b; a=1; while(a<10) {b=a; a=a+b;} return a;}'
+try 6 'int main(){int x; int *p; p=&x; x=4; *p=6; return x;}'
+try 4 'int main(){int x; x=3; if (x==3) x=4; else {x=5; return 1;} return x;}'
+try 15 'int main(){int i; int s; s=0; for(i=0; 2<1; i=i+1) s=9; for(i=0;i<5;i=i+1) s=s+i; return s;}'
+try 240 'int main(){int a[10]; int i; for(i=0;i<9;i=i+1) a[i]=i; int s; s=0; for(i=0;i<8;i=i+1) s = s + a[i] + a[i]*a[i]; return s;}'
+try 2 'int main(){char c; c=100; int x; x = c + 300; int y; y = c + 300; return (x == y) + (c+300 > 255);}'
+try 7 'int main(){int a[3]; int *p; p=a; a[0]=1; a[1]=2; int x; x = *(p+1); *(p+1) = 5; return x + *(p+1);}'
+try 11 'int g; int f(){g = g + 1; return g;} int main(){int x; g=1; x = g*3 + f(); return x + g*3;}'
+try 109 'int main(){int x; int y; x=3; y=x*x; if (y > 5) {x = x*x + 1;} else {y = x*x;} return x*x + y;}'
+try 125 'int main(){int i; int j; int s; s=0; j=3; i=0; while (i < 10) { s = s + j*j; i = i + 1; if (i == 5) j = 4; } return s;}'
+try 29 'int main(){int x; int *p; p=&x; x=2; int y; y = x*x; *p = 5; return y + x*x;}'
+try 55 'int main(){int i; int s; s=0; for (i=0; i<10; i=i+1) s=s+i; return s;}'
+try 44 'int main(){char c; c=300; return c;}'
+try 44 'int f(char c){return c;} int main(){return f(300);}'
+try 3 'int main(){int x; char c; x = c = 259; return x - 256;}'
+try 57 'int f(int a,int b,int c,int d,int e,int g){int h; int i; int j; int k; int l; h=a+b; i=c+d; j=e+g; k=h*i; l=j*k; return a+b+c+d+e+g+h+i+j+k+l-l-k+h+b*g;} int main(){return f(1,2,3,4,5,6);}'
+try 55 'int fib(int n){int a; int b; if (n < 2) return n; a = fib(n-1); b = fib(n-2); return a+b;} int main(){return fib(10);}'
+try 24 'int g(int x){int a; int b; int c; a=x; b=x; c=x; return a+b+c;} int main(){int i; int j; int s; s=0; j=2; for (i=0; i<3; i=i+1) s = s + g(i) + j; return s;}'
+try 69 'int main(){int a[10]; int i; int s; int n; n=3; s=0; a[0]=1; for(i=0;i<9;i=i+1) a[i]=i*n*n; for(i=0;i<9;i=i+1) s=s+a[i-1]; return s;}'
+try 141 'int main(){int a[10]; int i; int j; int s; s=0; for(i=0;i<10;i=i+1) a[i-1]=i; for(i=0;i<3;i=i+1) for(j=0;j<3;j=j+1) s=s+a[i+j]*a[j]; return s;}'
+try 63 'int main(){char b[8]; int i; int s; s=0; for(i=7;i>0;i=i-1) b[i]=i*3; for(i=0;i<7;i=i+1) s=s+b[i]; return s;}'
+try 16 'int main(){int a[5]; int *p; int i; int x; int y; x=2; y=3; p=a; for(i=-1;i<4;i=i+1) p[i]=x*y+i; return a[0]+a[4];}'
+try 125 'int main(){int x; int y; int i; int s; x=4; y=5; s=0; i=0; while(i<10){s=s+x*y; i=i+1; if(i==5) x=1;} return s;}'
+try 4 'int main(){int a[10]; int *q; int i; int c; c=0; a[1]=1; q=a+5; for(i=0;i<9;i=i+1){if((a+i)<q) c=c+a[1];} return c;}'
+try 1 'int main(){int a[10]; int *q; int i; int c; c=0; a[1]=1; q=a+5; for(i=0;i<9;i=i+1){if((a+i)==q) c=c+a[1];} return c;}'
+try 110 'int main(){int i; int s; int n; n=10; s=0; for(i=0;i<n*2;i=i+2) s=s+i; return s;}'
+try 10 'int f(int *p, int n){int i; int s; s=0; for(i=0;i<n;i=i+1) s=s+p[i-1]; return s;} int main(){int a[4]; a[0]=1;a[1]=2;a[2]=3;a[3]=4; return f(a,4);}'
+try 6 'int main(){int a[4]; int i; int j; a[0]=0;a[1]=0;a[2]=0;a[3]=0; for(i=0;i<3;i=i+1){ j=i; a[j]=a[i]+i; } return a[1]+a[2]+a[3];}'
+try 109 'int main(){int a[4]; int i; int s; s=0; a[0]=5;a[1]=6;a[2]=7;a[3]=8; for(i=4;i>0;i=i-1) s=s*2+a[i]; return s;}'
+try 234 'int f(int n){int i; int s; s=0; for(i=0;i<n;i=i+1) s=s*3+i; return s;} int main(){return f(0)+f(1)+f(2)+f(3)+f(4)+f(5)+f(7)+f(13)+f(100);}'
+try 102 'int f(int n){int i; int s; s=0; for(i=1;i<=n;i=i+3) s=s*3+i; return s+i;} int main(){return f(0)+f(1)+f(2)+f(3)+f(4)+f(5)+f(7)+f(13)+f(100);}'
+try 62 'int main(){int i; int s; s=0; for(i=0;i<5;i=i+1) s=s*2+i; return s+i;}'
+try 9 'int main(){int i; int s; s=0; for(i=9;i<5;i=i+1) s=s*2+i; return s+i;}'
+try 36 'int main(){int a[40]; int b[40]; int c[40]; int i; int s; for(i=0;i<40;i=i+1){a[i-1]=i; b[i-1]=i*3; c[i-1]=1;} for(i=0;i<37;i=i+1) c[i]=a[i]+b[i-1]; s=0; for(i=0;i<40;i=i+1) s=s+c[i-1]; return s;}'
+try 68 'int main(){char a[40]; char b[40]; char c[40]; int i; int s; for(i=0;i<40;i=i+1){a[i-1]=i*7; b[i-1]=i*3;} for(i=0;i<38;i=i+1) c[i]=a[i]-b[i]; s=0; for(i=0;i<39;i=i+1) s=s*3+c[i]; return s;}'
+try 70 'int main(){char a[40]; char b[40]; char c[40]; int i; int s; for(i=0;i<40;i=i+1){a[i-1]=i/3; b[i-1]=i/4;} for(i=0;i<39;i=i+1) c[i]=a[i]==b[i]; s=0; for(i=0;i<39;i=i+1) s=s*3+c[i]; return s;}'
+try 75 'int main(){int a[40]; int b[40]; int c[40]; int i; int s; for(i=0;i<40;i=i+1){a[i-1]=i/3; b[i-1]=i/4; c[i-1]=5;} for(i=-1;i<38;i=i+1) c[i]=a[i]==b[i]; s=0; for(i=0;i<39;i=i+1) s=s*3+c[i]; return s;}'
+try 185 'int a[100]; int b[100]; int main(){int i; int n; int s; n=99; for(i=0;i<100;i=i+1) a[i-1]=i; for(i=0;i<n;i=i+1) b[i]=a[i]; s=0; for(i=0;i<=n-1;i=i+1) s=s+b[i]; return s;}'
+try 167 'int main(){int a[100]; int i; int s; for(i=0;i<100;i=i+1) a[i-1]=i*i; s=7; for(i=2;i<=98;i=i+1) s=a[i]+s; return s;}'
+try 0 'int main(){int a[100]; int i; for(i=0;i<100;i=i+1) a[i-1]=i; for(i=0;i<98;i=i+1) a[i+1]=a[i]+a[i]; return a[50];}'
+try 52 'int main(){int a[100]; int i; for(i=0;i<100;i=i+1) a[i-1]=i; for(i=0;i<99;i=i+1) a[i]=a[i]+a[i]; return a[50]+a[98]+a[3];}'
+try 243 'int m(int a,int b){int x; if (a < b) x = a; else x = b; return x;} int main(){return m(3,9)+m(9,4)*10+m(-2,-1)*-100;}'
+try 17 'int f(int a,int b){int x; x = 7; if (a == b) x = a*b+1; return x;} int main(){return f(3,3)+f(2,3);}'
+try 3 'int f(int a,int b){int x; if (a <= b) x = 1; else x = 0; return x;} int main(){return f(3,3)+f(2,3)*2+f(4,3)*4;}'
+try 4 'int f(int a,int b){int x; if (a <= b) x = 0; else x = 1; return x;} int main(){return f(3,3)+f(2,3)*2+f(4,3)*4;}'
+try 5 'int f(int *p){int x; x = 0; if (p) x = *p; return x;} int main(){int a; a=5; return f(&a)+f(0);}'
+try 47 'int f(int a){char c; c = 3; if (a) c = 300; return c;} int main(){return f(1)+f(0);}'
+try 75 'int f(int a){int x; x=1; if ((x = a) < 3) x = 5; return x;} int main(){return f(1)+f(7)*10;}'
+try 104 'int g(int *p, int n){int i; for(i=0;i<n;i=i+1){ if (p[i-1]==5) return i; } return 99;} int main(){int a[20]; int i; for(i=0;i<20;i=i+1) a[i-1]=i; return g(a, 20) + g(a, 3);}'
+
+# Everything again in the other modes
+if [ -z "$OPTS" ]; then
+  OPTS=-fomit-frame-pointer ./test.sh || exit 1
+  OPTS=-j4 ./test.sh || exit 1
+  OPTS=--stream ./test.sh || exit 1
+  OPTS=-finstrument ./test.sh || exit 1
+  OPTS="-finstrument -fomit-frame-pointer" ./test.sh || exit 1
+  OPTS=-g ./test.sh || exit 1
+  OPTS=-O0 ./test.sh || exit 1
+  OPTS="-fprofile-generate -fomit-frame-pointer" ./test.sh || exit 1
+  OPTS=--unroll=3 ./test.sh || exit 1
+  OPTS=-O2 ./test.sh || exit 1
+  OPTS=-fPIC ./test.sh || exit 1
+
+  # The parallel frontend must produce the same assembly.
+  # It is large enough to be tokenized in chunks too.
+  src=$(for i in $(seq 2000); do
+    echo "int g$i; int f$i(int x){char *s; s=\"s$((i % 7))"
+    echo "\\\"x\"; g$i=x; return f$((i / 2))(x) + $i;}"
+  done)
+  echo "$src" | ./9cc - > tmp1.s || exit 1
+  echo "$src" | ./9cc -j4 - > tmp2.s || exit 1
+  cmp -s tmp1.s tmp2.s || { echo "-j4 output differs"; exit 1; }
+  # Line numbers must survive chunked tokenization.
+  echo "$src" | ./9cc -g - > tmp1.s || exit 1
+  echo "$src" | ./9cc -g -j4 - > tmp2.s || exit 1
+  cmp -s tmp1.s tmp2.s || { echo "-g -j4 output differs"; exit 1; }
+  grep -q '^  \.loc 1 4000 ' tmp1.s || { echo "-g line numbers are wrong"; exit 1; }
+  echo "-j4 output matches"
+
+  # --codegen-stats reports to stderr and leaves the assembly alone.
+  prog='int main(){int x; x=7; return x/2;}'
+  ./9cc --codegen-stats "$prog" 2>/dev/null | cmp -s - <(./9cc "$prog") ||
+    { echo "--codegen-stats changed the output"; exit 1; }
+  ./9cc --codegen-stats=json "$prog" 2>&1 >/dev/null | grep -q '"idiv": 1' ||
+    { echo "--codegen-stats=json did not count idiv"; exit 1; }
+  # Dead stores are removed. x lives in a register, so only x=7 is left.
+  ./9cc 'int main(){int x; int y; x=5; y=x; x=7; return x;}' |
+    grep -qw 5 && { echo "dead stores were not removed"; exit 1; }
+  ./9cc -O0 --codegen-stats=json 'int main(){int x; x=5; return x;}' 2>&1 >/dev/null |
+    grep -q '"store": 1,' || { echo "--codegen-stats did not count the store"; exit 1; }
+  # &a[i] is computed once.
+  ./9cc 'int main(){int a[4]; int i; i=2; a[i]=3; a[i] = a[i] + a[i]; return a[i];}' |
+    grep -c '\*4' | grep -qx 1 || { echo "a[i] was computed more than once"; exit 1; }
+  # a[i] in a loop becomes a pointer increment, and x*y is computed
+  # before the loop.
+  ./9cc 'int main(){int a[10]; int i; int x; int y; x=2; y=3; for(i=0;i<9;i=i+1) a[i]=x*y; return a[4];}' |
+    sed -n '/^\.Lbegin0:/,/^\.Lend0:/p' | grep -qE 'imul|\*4' && { echo "loop was not strength-reduced"; exit 1; }
+  # A short constant loop is unrolled completely.
+  ./9cc --unroll=4 'int main(){int i; int s; s=0; for(i=0;i<5;i=i+1) s=s*2+i; return s;}' |
+    grep -q Lbegin && { echo "constant loop was not unrolled"; exit 1; }
+  # Elementwise array loops use SSE2 at -O2.
+  ./9cc -O2 'int main(){int a[40]; int b[40]; int i; for(i=0;i<39;i=i+1) a[i]=b[i]+a[i]; return a[3];}' |
+    grep -q paddd || { echo "loop was not vectorized"; exit 1; }
+  # A small if/else becomes a cmov.
+  ./9cc 'int m(int a,int b){int x; if (a < b) x = a; else x = b; return x;}' > tmp.s
+  grep -q cmov tmp.s && ! grep -q 'je ' tmp.s || { echo "if was not converted"; exit 1; }
+  # Leaves are used as operands in place: x = x + 1 updates memory, and
+  # a comparison with a constant branches on the flags.
+  ./9cc -O0 'int main(){int x; x=0; while (x < 10) x = x + 1; return x;}' > tmp.s
+  grep -q 'add dword ptr \[rbp-[0-9]*\], 1' tmp.s || { echo "x = x + 1 was not done in place"; exit 1; }
+  grep -A1 'cmp rax, 10' tmp.s | grep -q 'jge \.Lend' || { echo "compare was not fused with the branch"; exit 1; }
+  echo "--codegen-stats OK"
+
+  # CFI lets the unwinder walk through frames without a frame pointer.
+  # main's call to f is a tail call, so it has no frame of its own.
+  echo '#include <execinfo.h>
+int bt(){ void *b[64]; return backtrace(b, 64); }' > tmp_bt.c
+  prog='int f(int n){int a[3]; a[1]=n; if(n==0) return bt()+a[1]; return f(n-1)+0;} int main(){return f(5);}'
+  for opts in "" -fomit-frame-pointer; do
+    ./9cc $opts "$prog" > tmp.s && gcc -o tmp tmp.s tmp_bt.c
+    ./tmp
+    frames="$?"
+    [ "$frames" = 10 ] || { echo "unwound $frames frames with '$opts'"; exit 1; }
+  done
+  rm -f tmp_bt.c
+  echo "CFI OK"
+
+  # -fPIC output links into a shared object.
+  ./9cc -fPIC 'int g; int a[4]; int bump(int n){a[n] = n; g = g + n; return g + a[n];}' > tmp_lib.s
+  grep -q 'GOTPCREL' tmp_lib.s || { echo "-fPIC did not use the GOT"; exit 1; }
+  gcc -shared -o libtmp.so tmp_lib.s
+  ./9cc 'int main(){bump(3); return bump(2);}' > tmp.s && gcc -o tmp tmp.s ./libtmp.so
+  LD_LIBRARY_PATH=. ./tmp
+  [ "$?" = 7 ] || { echo "shared object is wrong"; exit 1; }
+  rm -f tmp_lib.s libtmp.so
+  echo "-fPIC OK"
+
+  # -finstrument appends call counts and cycles to 9cc.prof at exit.
+  rm -f 9cc.prof
+  OPTS=-finstrument try 55 'int fib(int n){if(n<2) return n; return fib(n-1)+fib(n-2);} int main(){return fib(10);}'
+  grep -q '^fib 177 [0-9]*$' 9cc.prof && grep -q '^main 1 [0-9]*$' 9cc.prof ||
+    { echo "9cc.prof is wrong"; cat 9cc.prof; exit 1; }
+  rm -f 9cc.prof
+  echo "-finstrument OK"
+
+  # -fprofile-generate records branch counts in 9cc.pgo, and
+  # -fprofile-use lays the code out by them.
+  rm -f 9cc.pgo
+  prog='int g; int f(int x){if (x == 1000) return 0; if (x == 7) g = g + 3; else g = g + 1; return g;} int main(){int i; for (i = 0; i < 100; i = i + 1) f(i); if (g == 5) return 1; return g - 72;}'
+  OPTS=-fprofile-generate try 30 "$prog"
+  ./tmp
+  [ "$(grep -c '^f 5 100 100 0 100 1$' 9cc.pgo)" = 2 ] ||
+    { echo "9cc.pgo is wrong"; cat 9cc.pgo; exit 1; }
+  OPTS=-fprofile-use try 30 "$prog"
+  grep -q '^\.Lcond' tmp.s || { echo "hot loop was not rotated"; exit 1; }
+  grep -q 'j[a-z]* \.Lthen' tmp.s || { echo "cold branch was not moved"; exit 1; }
+  [ "$(grep -m1 '^\.type' tmp.s)" = ".type f, @function" ] || { echo "hot function is not first"; exit 1; }
+  rm -f 9cc.pgo
+
+  # Only the loop that runs many iterations per entry is unrolled.
+  prog='int f(int n){int i; int s; s=0; for(i=0;i<n;i=i+1) s=s+i; return s;} int main(){int k; int t; t=0; for(k=0;k<50;k=k+1) t=t+f(2); return t;}'
+  OPTS="-fprofile-generate --unroll=4" try 150 "$prog"
+  OPTS="-fprofile-use --unroll=4" try 150 "$prog"
+  [ "$(awk '/^[a-z]+:/{f=$1} /^\.Lbegin/{print f}' tmp.s | tr '\n' ' ')" = "f: main: main: " ] ||
+    { echo "profile did not guide unrolling"; exit 1; }
+  rm -f 9cc.pgo
+  echo "profile OK"
+  exit 0
+fi
 
 echo OK
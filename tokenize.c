@@ -1,7 +1,7 @@
 #include "9cc.h"
 
 // 現在着目しているトークン
-Token *token;
+_Thread_local Token *token;
 
 // include string.hしても関数が見つからずにwarningになってしまうため
 // 解決策が見つかるまで自前で定義
@@ -160,138 +160,324 @@ static char get_escape_char(char c) {
   }
 }
 
+// Escaped string literals are decoded into large blocks carved up
+// from the front.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+static char *arena_alloc(int size) {
+  static _Thread_local char *cur;
+  static _Thread_local int left;
+
+  if (size > ARENA_BLOCK_SIZE / 4)
+    return malloc(size);
+
+  if (left < size) {
+    cur = malloc(ARENA_BLOCK_SIZE);
+    left = ARENA_BLOCK_SIZE;
+  }
+  char *p = cur;
+  cur += size;
+  left -= size;
+  return p;
+}
+
+// A literal without escapes points right into the source text.
+// Otherwise it is decoded once into the arena. Either way the contents
+// are not NUL-terminated.
 static Token *read_string_literal(Token *cur, char *start) {
   char *p = start + 1;
-  char buf[1024];
   int len = 0;
+  bool has_escape = false;
 
-  for (;;) {
-    if (len == sizeof(buf))
-      error_at(start, "文字列リテラルが大きすぎます");
+  for (; *p != '"'; p++, len++) {
     if (*p == '\0')
       error_at(start, "文字列リテラルが閉じられていません");
-    if (*p == '"')
-      break;
+    if (*p == '\\') {
+      has_escape = true;
+      if (*++p == '\0')
+        error_at(start, "文字列リテラルが閉じられていません");
+    }
+  }
+
+  Token *tok = new_token(TK_STR, cur, start, p - start + 1);
+  tok->cont_len = len;
 
+  if (!has_escape) {
+    tok->contents = start + 1;
+    return tok;
+  }
+
+  char *buf = arena_alloc(len);
+  p = start + 1;
+  for (int i = 0; i < len; i++) {
     if (*p == '\\') {
       p++;
-      buf[len++] = get_escape_char(*p++);
+      buf[i] = get_escape_char(*p++);
     } else {
-      buf[len++] = *p++;
+      buf[i] = *p++;
     }
   }
-
-  Token *tok = new_token(TK_STR, cur, start, p - start + 1);
-  tok->contents = malloc(len + 1);
-  memcpy(tok->contents, buf, len);
-  tok->contents[len] = '\0';
-  tok->cont_len = len + 1;
+  tok->contents = buf;
   return tok;
 }
 
-// 入力文字列pをトークナイズしてそれを返す
-void tokenize() {
-  Token head;
-  head.next = NULL;
-  Token *cur = &head;
-  char *p = user_input;
+// pから始まるトークンを1つ読んでcurに繋げる
+// 呼び出し側は次のトークンをtok->str + tok->lenから読む
+static Token *read_token(char *p, Token *cur) {
+  if (strncmp(p, "return", 6) == 0 && !is_alnum(p[6])) {
+    return new_token(TK_RETURN, cur, p, 6);
+  }
+
+  if (strncmp(p, "sizeof", 6) == 0 && !is_alnum(p[6])) {
+    return new_token(TK_RESERVED, cur, p, 6);
+  }
 
-  while (*p) {
-    // 空白文字をスキップ
-    if (isspace(*p)) {
+  if (strncmp(p, "while", 5) == 0 && !is_alnum(p[5])) {
+    return new_token(TK_WHILE, cur, p, 5);
+  }
+
+  if (strncmp(p, "else", 4) == 0 && !is_alnum(p[4])) {
+    return new_token(TK_ELSE, cur, p, 4);
+  }
+
+  if (strncmp(p, "char", 4) == 0 && !is_alnum(p[4])) {
+    return new_token(TK_CHAR, cur, p, 4);
+  }
+
+  if (strncmp(p, "for", 3) == 0 && !is_alnum(p[3])) {
+    return new_token(TK_FOR, cur, p, 3);
+  }
+
+  if (strncmp(p, "int", 3) == 0 && !is_alnum(p[3])) {
+    return new_token(TK_INT, cur, p, 3);
+  }
+
+  if (strncmp(p, "if", 2) == 0 && !is_alnum(p[2])) {
+    return new_token(TK_IF, cur, p, 2);
+  }
+
+  if(startswith(p, "==") || startswith(p, "!=") ||
+     startswith(p, "<=") || startswith(p, ">=")) {
+    return new_token(TK_RESERVED, cur, p, 2);
+  }
+
+  // String literal
+  if (*p == '"') {
+    return read_string_literal(cur, p);
+  }
+
+  if (strchr("+-*/()<>{}=;,&[]", *p) != NULL )
+  {
+    return new_token(TK_RESERVED, cur, p, 1);
+  }
+
+  if (is_alpha(*p)) {
+    char* q = p++;
+    while(is_alnum(*p))
       p++;
-      continue;
-    }
+    return new_token(TK_IDENT, cur, q, p-q);
+  }
 
-    if (strncmp(p, "return", 6) == 0 && !is_alnum(p[6])) {
-      cur = new_token(TK_RETURN, cur, p, 6);
-      p += 6;
-      continue;
-    }
+  if (isdigit(*p)) {
+    cur = new_token(TK_NUM, cur, p, 0);
+    char* q = p;
+    cur->val = strtol(p, &p, 10);
+    cur->len = p - q;
+    return cur;
+  }
 
-    if (strncmp(p, "sizeof", 6) == 0 && !is_alnum(p[6])) {
-      cur = new_token(TK_RESERVED, cur, p, 6);
-      p += 6;
-      continue;
-    }
+  error("トークナイズできません");
+  return NULL;
+}
 
-    if (strncmp(p, "while", 5) == 0 && !is_alnum(p[5])) {
-      cur = new_token(TK_WHILE, cur, p, 5);
-      p += 5;
-      continue;
-    }
+// Current position of a lexer, with its line and column.
+typedef struct {
+  char *p;
+  int line;
+  char *line_start;
+} Lexer;
 
-    if (strncmp(p, "else", 4) == 0 && !is_alnum(p[4])) {
-      cur = new_token(TK_ELSE, cur, p, 4);
-      p += 4;
-      continue;
-    }
+static void newline(Lexer *lx, char *p) {
+  lx->line++;
+  lx->line_start = p + 1;
+}
 
-    if (strncmp(p, "char", 4) == 0 && !is_alnum(p[4])) {
-      cur = new_token(TK_CHAR, cur, p, 4);
-      p += 4;
-      continue;
-    }
+// 空白文字をスキップ
+static void skip_space(Lexer *lx, char *end) {
+  for (; lx->p < end && isspace(*lx->p); lx->p++)
+    if (*lx->p == '\n')
+      newline(lx, lx->p);
+}
 
-    if (strncmp(p, "for", 3) == 0 && !is_alnum(p[3])) {
-      cur = new_token(TK_FOR, cur, p, 3);
-      p += 3;
-      continue;
-    }
+static Token *lex_token(Lexer *lx, Token *cur) {
+  cur = read_token(lx->p, cur);
+  cur->line = lx->line;
+  cur->col = lx->p - lx->line_start + 1;
+  lx->p = cur->str + cur->len;
+
+  // A string literal may span lines.
+  if (cur->kind == TK_STR)
+    for (char *q = cur->str; q < lx->p; q++)
+      if (*q == '\n')
+        newline(lx, q);
+  return cur;
+}
 
-    if (strncmp(p, "int", 3) == 0 && !is_alnum(p[3])) {
-      cur = new_token(TK_INT, cur, p, 3);
-      p += 3;
-      continue;
-    }
+// [lx->p, end)をトークナイズしてcurに繋げ、最後のトークンを返す
+static Token *tokenize_range(Lexer *lx, char *end, Token *cur) {
+  for (;;) {
+    skip_space(lx, end);
+    if (lx->p >= end)
+      return cur;
+    cur = lex_token(lx, cur);
+  }
+}
 
-    if (strncmp(p, "if", 2) == 0 && !is_alnum(p[2])) {
-      cur = new_token(TK_IF, cur, p, 2);
-      p += 2;
-      continue;
-    }
+// Inputs at least this large per thread are tokenized in parallel.
+#define MIN_CHUNK_SIZE (16 * 1024)
 
-    if(startswith(p, "==") || startswith(p, "!=") ||
-       startswith(p, "<=") || startswith(p, ">=")) {
-      cur = new_token(TK_RESERVED, cur, p, 2);
-      p += 2;
-      continue;
-    }
+typedef struct {
+  char *start;
+  char *end;
+  int line;
+  Token head;
+  Token *tail;
+} Chunk;
+
+static int tokenize_chunk(void *arg) {
+  Chunk *c = arg;
+  c->head.next = NULL;
+  Lexer lx = {c->start, c->line, c->start};
+  c->tail = tokenize_range(&lx, c->end, &c->head);
+  return 0;
+}
 
-    // String literal
-    if (*p == '"') {
-      cur = read_string_literal(cur, p);
-      p += cur->len;
-      continue;
+// Splits the input into at most n chunks of about equal size. Chunks end
+// right after a newline that is not inside a string literal, so no token
+// spans two chunks. Returns the number of chunks.
+static int split_input(char *p, int len, Chunk *chunks, int n) {
+  int nchunks = 0;
+  char *start = p;
+  char *end = p + len;
+  bool in_string = false;
+  int line = 1;
+  int start_line = 1;
+
+  for (int i = 1; i < n; i++) {
+    char *target = p + (long)len * i / n;
+
+    for (; p < end; p++) {
+      if (*p == '\n')
+        line++;
+      if (in_string) {
+        if (*p == '\\' && p + 1 < end) {
+          if (*++p == '\n')
+            line++;
+        } else if (*p == '"')
+          in_string = false;
+        continue;
+      }
+      if (*p == '"')
+        in_string = true;
+      else if (*p == '\n' && p >= target)
+        break;
     }
+    if (p == end)
+      break;
 
-    if (strchr("+-*/()<>{}=;,&[]", *p) != NULL )
-    {
-      cur = new_token(TK_RESERVED, cur, p++, 1);
-      continue;
-    }
+    chunks[nchunks++] = (Chunk){start, ++p, start_line};
+    start = p;
+    start_line = line;
+  }
 
-    if (is_alpha(*p)) {
-      char* q = p++;
-      while(is_alnum(*p))
-        p++;
-      cur = new_token(TK_IDENT, cur, q, p-q);
-      continue;
-    }
+  chunks[nchunks++] = (Chunk){start, end, start_line};
+  return nchunks;
+}
 
-    if (isdigit(*p)) {
-      cur = new_token(TK_NUM, cur, p, 0);
-      char* q = p;
-      cur->val = strtol(p, &p, 10);
-      cur->len = p - q;
-      continue;
-    }
+// 入力文字列をトークナイズしてtokenに設定する
+//
+// With -j<N>, large inputs are split into chunks that are tokenized on
+// separate threads and then stitched together.
+void tokenize() {
+  int len = strlen(user_input);
+  int n = len / MIN_CHUNK_SIZE;
+  if (n > jobs)
+    n = jobs;
+  if (n < 1)
+    n = 1;
+
+  Chunk *chunks = calloc(n, sizeof(Chunk));
+  n = split_input(user_input, len, chunks, n);
+
+  if (n == 1) {
+    tokenize_chunk(&chunks[0]);
+  } else {
+    thrd_t *threads = calloc(n, sizeof(thrd_t));
+    for (int i = 0; i < n; i++)
+      if (thrd_create(&threads[i], tokenize_chunk, &chunks[i]) != thrd_success)
+        error("スレッドを作成できません");
+    for (int i = 0; i < n; i++)
+      thrd_join(threads[i], NULL);
+    free(threads);
+  }
 
-    error("トークナイズできません");
+  Token head = {};
+  Token *cur = &head;
+  for (int i = 0; i < n; i++) {
+    if (!chunks[i].head.next)
+      continue;
+    cur->next = chunks[i].head.next;
+    cur = chunks[i].tail;
   }
 
-  new_token(TK_EOF, cur, p, 0);
+  new_token(TK_EOF, cur, user_input + len, 0);
   token = head.next;
-  return;
+  free(chunks);
 }
 
+
+// --stream: lexes only the next top-level declaration, which ends at a
+// ";" or "}" outside any parentheses and braces. The returned list is
+// terminated by an EOF token, which is the only token at the end of
+// the input.
+Token *tokenize_decl(void) {
+  static Lexer lx;
+  static char *end;
+  if (!lx.p) {
+    lx = (Lexer){user_input, 1, user_input};
+    end = user_input + strlen(user_input);
+  }
+
+  Token head = {};
+  Token *cur = &head;
+  int depth = 0;
+
+  for (;;) {
+    skip_space(&lx, end);
+    if (lx.p >= end)
+      break;
+
+    cur = lex_token(&lx, cur);
+
+    if (cur->kind == TK_RESERVED && cur->len == 1) {
+      char c = *cur->str;
+      if (c == '(' || c == '{')
+        depth++;
+      else if (c == ')' || c == '}')
+        depth--;
+      if (depth == 0 && (c == ';' || c == '}'))
+        break;
+    }
+  }
+
+  new_token(TK_EOF, cur, lx.p, 0);
+  return head.next;
+}
+
+void free_tokens(Token *tok) {
+  while (tok) {
+    Token *next = tok->next;
+    free(tok);
+    tok = next;
+  }
+}